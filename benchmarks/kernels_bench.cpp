@@ -0,0 +1,115 @@
+/*-
+ * Copyright 2016 Jakub Nyckowski
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "simd.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+///
+/// \brief Measure throughput of a kernel
+/// \param bytes  Number of bytes touched by one call
+/// \param kernel Kernel invocation
+/// \return Throughput in GB/s
+///
+double measure(size_t bytes, const std::function<void()> &kernel) {
+  using clock = std::chrono::steady_clock;
+  kernel();  // warm up caches and page tables
+  size_t calls = 0;
+  auto start = clock::now();
+  std::chrono::duration<double> elapsed(0);
+  do {
+    kernel();
+    ++calls;
+    elapsed = clock::now() - start;
+  } while (elapsed.count() < 0.25);
+  return static_cast<double>(bytes) * calls / elapsed.count() / 1e9;
+}
+
+void run(size_t size) {
+  std::vector<uint8_t> a(size);
+  std::vector<uint8_t> b(size);
+  std::vector<uint8_t> out(size);
+  std::mt19937 gen(42);
+  for (auto &c : a) c = static_cast<uint8_t>(gen());
+  b = a;
+  // Make mismatch search run over the whole buffer
+  b[size - 1] ^= 1;
+
+  // Every kernel reads two buffers and writes at most one, memcpy reads one
+  // and writes one, so it is the bandwidth reference
+  std::printf("%10zu KiB  memcpy     %8.2f GB/s\n", size / 1024,
+              measure(2 * size, [&] {
+                std::memcpy(out.data(), a.data(), size);
+              }));
+
+  for (int level = 0; level <= static_cast<int>(simd::cpu_isa); ++level) {
+    simd::isa isa = static_cast<simd::isa>(level);
+    simd::subtract_fn subtract = simd::select_subtract(isa);
+    simd::add_fn add = simd::select_add(isa);
+    simd::mismatch_fn mismatch = simd::select_mismatch(isa);
+    volatile size_t sink = 0;
+
+    std::printf("%10zu KiB  %-8s  subtract %8.2f GB/s  add %8.2f GB/s  "
+                "mismatch %8.2f GB/s\n",
+                size / 1024, simd::isa_name(isa),
+                measure(3 * size, [&] {
+                  subtract(out.data(), a.data(), b.data(), size);
+                }),
+                measure(3 * size, [&] { add(out.data(), b.data(), size); }),
+                measure(2 * size,
+                        [&] { sink = mismatch(a.data(), b.data(), size); }));
+    (void)sink;
+  }
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  // Cache resident and memory bound sizes
+  std::vector<size_t> sizes = {32 * 1024, 256 * 1024 * 1024};
+  if (argc > 1) {
+    sizes.clear();
+    for (int i = 1; i < argc; ++i)
+      sizes.push_back(std::strtoull(argv[i], nullptr, 10) * 1024);
+  }
+
+  std::printf("Detected instruction set: %s\n",
+              simd::isa_name(simd::cpu_isa));
+  for (size_t size : sizes) {
+    if (size == 0) continue;
+    run(size);
+  }
+  return 0;
+}
@@ -0,0 +1,118 @@
+/*-
+ * Copyright 2016 Jakub Nyckowski
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "generate_sa.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+///
+/// \brief Measure time of one call
+/// \return Time in seconds
+///
+double measure(const std::function<void()> &build) {
+  auto start = std::chrono::steady_clock::now();
+  build();
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+///
+/// \brief Synthetic old file
+/// \param kind random, text (repeats with edits) or zeros
+///
+std::vector<uint8_t> corpus(const std::string &kind, size_t size) {
+  std::vector<uint8_t> data(size);
+  std::mt19937 gen(42);
+  for (size_t i = 0; i < size; ++i) {
+    if (kind == "random") {
+      data[i] = static_cast<uint8_t>(gen());
+    } else if (kind == "text") {
+      // Copies of earlier data with a few changed bytes, like source code
+      size_t distance = 512 * (1 + gen() % 8);
+      data[i] = i >= distance && gen() % 64
+                    ? data[i - distance]
+                    : static_cast<uint8_t>('a' + gen() % 26);
+    }
+  }
+  return data;
+}
+
+void run(const std::string &kind, size_t size, uint32_t max_threads) {
+  std::vector<uint8_t> data = corpus(kind, size);
+  const int32_t n = static_cast<int32_t>(size);
+  std::vector<int32_t> expected(size);
+  std::vector<int32_t> sa(size);
+
+  double divsufsort_time = measure([&] {
+    generate_suffix_array<int32_t>(data.data(), expected.data(), n);
+  });
+  std::printf("%-6s %8zu KiB  divsufsort        %8.2f MB/s\n", kind.c_str(),
+              size / 1024, size / divsufsort_time / 1e6);
+
+  for (uint32_t threads = 1; threads <= max_threads; threads *= 2) {
+    double time = measure([&] {
+      build_suffix_array<int32_t>(sa_builder_id::parallel, data.data(),
+                                  sa.data(), n, threads);
+    });
+    std::printf("%-6s %8zu KiB  parallel %2u threads %8.2f MB/s%s\n",
+                kind.c_str(), size / 1024, threads, size / time / 1e6,
+                sa == expected ? "" : "  WRONG RESULT");
+  }
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  // Size in KiB, then kinds of data
+  size_t size = argc > 1 ? std::strtoull(argv[1], nullptr, 10) * 1024
+                         : 64 * 1024 * 1024;
+  const std::vector<std::string> known_kinds = {"random", "text", "zeros"};
+  std::vector<std::string> kinds = known_kinds;
+  if (argc > 2) kinds.assign(argv + 2, argv + argc);
+  for (const auto &kind : kinds) {
+    if (std::find(known_kinds.begin(), known_kinds.end(), kind) ==
+        known_kinds.end()) {
+      std::fprintf(stderr, "Unknown kind of data: %s\n", kind.c_str());
+      return 1;
+    }
+  }
+
+  uint32_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+  for (const auto &kind : kinds) run(kind, size, max_threads);
+  return 0;
+}
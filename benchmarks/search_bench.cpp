@@ -0,0 +1,398 @@
+/*-
+ * Copyright 2016 Jakub Nyckowski
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "andiff.hpp"
+#include "spsc_queue.hpp"
+#include "synchronized_queue.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace {
+
+/// Number of searched positions of new file
+constexpr size_t searches_number = 64 * 1024;
+
+///
+/// \brief Read cycle counter
+/// Time stamp counter ticks at nominal frequency of the processor, not at
+/// the frequency the core actually runs with. Other architectures count
+/// nanoseconds.
+///
+inline uint64_t cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+#endif
+}
+
+///
+/// \brief Measure cycles of a call, the best of a few runs
+/// \param runs   Number of runs, phases which take long run once
+/// \param kernel Measured call
+///
+uint64_t measure(int runs, const std::function<void()> &kernel) {
+  uint64_t best = UINT64_MAX;
+  for (int i = 0; i < runs; ++i) {
+    uint64_t start = cycles();
+    kernel();
+    best = std::min(best, cycles() - start);
+  }
+  return best;
+}
+
+///
+/// \brief Suffix array which counts rows read by a search
+///
+template <typename I>
+class counting_array {
+ public:
+  explicit counting_array(const I *data) : m_data(data), m_reads(0) {}
+
+  I operator[](size_t pos) const {
+    ++m_reads;
+    return m_data[pos];
+  }
+
+  void prefetch(size_t) const {}
+
+  size_t reads() const { return m_reads; }
+
+ private:
+  const I *m_data;         ///< Suffix array
+  mutable size_t m_reads;  ///< Rows read so far
+};
+
+///
+/// \brief Synthetic old file
+/// \param kind random, low-entropy (few frequent bytes), repetitive (copies
+///             of earlier data with edits) or executable (code with relative
+///             calls, padding and string tables)
+///
+std::vector<uint8_t> corpus(const std::string &kind, size_t size) {
+  std::vector<uint8_t> data;
+  data.reserve(size);
+  std::mt19937 gen(42);
+  if (kind == "random") {
+    while (data.size() < size) data.push_back(static_cast<uint8_t>(gen()));
+  } else if (kind == "low-entropy") {
+    // About two bits per byte
+    std::geometric_distribution<int> symbol(0.5);
+    while (data.size() < size) {
+      data.push_back(static_cast<uint8_t>('a' + std::min(symbol(gen), 25)));
+    }
+  } else if (kind == "repetitive") {
+    while (data.size() < size) {
+      size_t distance = 512 * (1 + gen() % 8);
+      size_t i = data.size();
+      data.push_back(i >= distance && gen() % 64
+                         ? data[i - distance]
+                         : static_cast<uint8_t>('a' + gen() % 26));
+    }
+  } else if (kind == "executable") {
+    // Functions built from a small set of instructions. Calls hold distance
+    // to one of earlier functions, so the same call differs at every place.
+    static const std::vector<std::vector<uint8_t>> instructions = {
+        {0x48, 0x89, 0xe5}, {0x48, 0x8b, 0x45, 0xf8}, {0x89, 0x7d, 0xfc},
+        {0x48, 0x83, 0xc4, 0x10}, {0x31, 0xc0}, {0x0f, 0x1f, 0x40, 0x00}};
+    std::vector<size_t> functions;
+    while (data.size() < size) {
+      if (gen() % 32 == 0) {
+        // String table
+        for (size_t i = gen() % 256; i > 0; --i) {
+          data.push_back(i % 8 ? static_cast<uint8_t>('a' + gen() % 26) : 0);
+        }
+        continue;
+      }
+      functions.push_back(data.size());
+      data.push_back(0x55);
+      for (size_t i = 4 + gen() % 32; i > 0; --i) {
+        if (gen() % 4 == 0) {
+          const int32_t distance = static_cast<int32_t>(
+              functions[gen() % functions.size()] - data.size() - 5);
+          data.push_back(0xe8);
+          for (int b = 0; b < 4; ++b) {
+            data.push_back(static_cast<uint8_t>(distance >> (8 * b)));
+          }
+        } else {
+          const auto &op = instructions[gen() % instructions.size()];
+          data.insert(data.end(), op.begin(), op.end());
+        }
+      }
+      data.push_back(0xc3);
+      while (data.size() % 16) data.push_back(0xcc);
+    }
+  }
+  data.resize(size);
+  return data;
+}
+
+///
+/// \brief New file made of old file with replaced, inserted and removed
+///        bytes, so matches are a few hundred bytes long
+///
+std::vector<uint8_t> mutate(const std::vector<uint8_t> &source) {
+  std::vector<uint8_t> data;
+  data.reserve(source.size());
+  std::mt19937 gen(7);
+  for (size_t i = 0; i < source.size(); ++i) {
+    switch (gen() % 512) {
+      case 0:
+        data.push_back(static_cast<uint8_t>(gen()));
+        break;
+      case 1:
+        data.push_back(static_cast<uint8_t>(gen()));
+        data.push_back(source[i]);
+        break;
+      case 2:
+        break;
+      default:
+        data.push_back(source[i]);
+    }
+  }
+  return data;
+}
+
+void print(const std::string &kind, size_t size, const char *phase,
+           double value, const char *unit) {
+  std::printf("%-12s %8zu KiB  %-28s %10.2f %s\n", kind.c_str(), size / 1024,
+              phase, value, unit);
+}
+
+void run(const std::string &kind, size_t size, uint32_t threads) {
+  std::vector<uint8_t> source_data = corpus(kind, size);
+  std::vector<uint8_t> target_data = mutate(source_data);
+  data_view source(source_data);
+  data_view target(target_data);
+  const int32_t n = static_cast<int32_t>(size);
+  const double bytes = static_cast<double>(size);
+
+  index_array<int32_t> SA;
+  for (auto builder : {sa_builder_id::divsufsort, sa_builder_id::parallel}) {
+    uint64_t time = measure(1, [&] {
+      SA = make_suffix_array<int32_t>(builder, source.data(), size, threads);
+    });
+    print(kind, size,
+          builder == sa_builder_id::divsufsort
+              ? "generate_suffix_array"
+              : "generate_suffix_array par",
+          time / bytes, "cycles/byte");
+  }
+  prefix_table<int32_t> table;
+  table.build(SA, source);
+
+  std::vector<int32_t> lcp_lr(size);
+  for (uint32_t t : {1u, threads}) {
+    uint64_t time = measure(1, [&] {
+      calculate_lcp(source.data(), SA.data(), n, lcp_lr.data(), t);
+    });
+    print(kind, size, t == 1 ? "calculate_lcp" : "calculate_lcp par",
+          time / bytes, "cycles/byte");
+    if (threads == 1) break;
+  }
+  for (uint32_t t : {1u, threads}) {
+    // LCP-LR overwrites LCP, which is computed again outside of measurement
+    if (t != 1) calculate_lcp(source.data(), SA.data(), n, lcp_lr.data(), t);
+    uint64_t time =
+        measure(1, [&] { calculate_lcp_lr(lcp_lr.data(), n, t); });
+    print(kind, size, t == 1 ? "calculate_lcp_lr" : "calculate_lcp_lr par",
+          time / bytes, "cycles/byte");
+    if (threads == 1) break;
+  }
+  std::vector<lcp_node<int32_t>> tree =
+      calculate_lcp_tree(SA.data(), n, lcp_lr.data());
+  size_t tree_levels = 0;
+  while ((size_t(1) << tree_levels) < tree.size()) ++tree_levels;
+
+  // Batches of consecutive positions, like comparison threads search them
+  std::mt19937 gen(3);
+  const int32_t last = static_cast<int32_t>(target.size()) -
+                       static_cast<int32_t>(andiff_search_batch);
+  std::vector<int32_t> scans;
+  while (scans.size() < searches_number) {
+    const int32_t scan = static_cast<int32_t>(gen() % last);
+    for (size_t j = 0; j < andiff_search_batch; ++j) {
+      scans.push_back(scan + static_cast<int32_t>(j));
+    }
+  }
+  const double searches = static_cast<double>(scans.size());
+  std::vector<int32_t> len(scans.size());
+  std::vector<int32_t> pos(scans.size());
+
+  // Probe is a row of suffix array or a node of search tree compared with
+  // pattern, they are counted outside of measured loops
+  counting_array<int32_t> counted(SA.data());
+  for (int32_t scan : scans) {
+    int32_t found;
+    search_bucket(counted, table, source, target, scan, &found);
+  }
+  const double simple_probes = counted.reads() / searches;
+
+  uint64_t time = measure(3, [&] {
+    for (size_t i = 0; i < scans.size(); ++i) {
+      len[i] = search_bucket(SA, table, source, target, scans[i], &pos[i]);
+    }
+  });
+  print(kind, size, "search_simple", time / searches, "cycles/search");
+  print(kind, size, "search_simple", simple_probes, "probes/search");
+
+  time = measure(3, [&] {
+    for (size_t i = 0; i < scans.size(); i += andiff_search_batch) {
+      search_bucket_batch(SA, table, source, target, scans[i],
+                          andiff_search_batch, &len[i], &pos[i]);
+    }
+  });
+  print(kind, size, "search_simple batch", time / searches, "cycles/search");
+
+  counting_array<int32_t> counted_lcp(SA.data());
+  for (int32_t scan : scans) {
+    int32_t found;
+    search_lcp(counted_lcp, source.data(), n, &target[scan],
+               static_cast<int32_t>(target.size()) - scan, &found,
+               lcp_lr.data(), tree.data(), tree.size());
+  }
+  const double lcp_probes = counted_lcp.reads() / searches + tree_levels;
+
+  time = measure(3, [&] {
+    for (size_t i = 0; i < scans.size(); ++i) {
+      len[i] = search_lcp(SA.data(), source.data(), n, &target[scans[i]],
+                          static_cast<int32_t>(target.size()) - scans[i],
+                          &pos[i], lcp_lr.data(), tree.data(), tree.size());
+    }
+  });
+  print(kind, size, "search_lcp", time / searches, "cycles/search");
+  print(kind, size, "search_lcp", lcp_probes, "probes/search");
+
+  time = measure(3, [&] {
+    for (size_t i = 0; i < scans.size(); i += andiff_search_batch) {
+      search_lcp_batch(SA, source.data(), n, &target[scans[i]],
+                       static_cast<int32_t>(target.size()) - scans[i],
+                       andiff_search_batch, &len[i], &pos[i], lcp_lr.data(),
+                       tree.data(), tree.size());
+    }
+  });
+  print(kind, size, "search_lcp batch", time / searches, "cycles/search");
+
+  // Byte comparisons of found matches, compare_pattern skips the first half
+  // of match as if search already knew it
+  double matched = 0;
+  for (int32_t l : len) matched += l + 1;
+  volatile int32_t sink = 0;
+  time = measure(3, [&] {
+    for (size_t i = 0; i < scans.size(); ++i) {
+      sink = matchlen(source.data() + pos[i], n - pos[i], &target[scans[i]],
+                      static_cast<int32_t>(target.size()) - scans[i]);
+    }
+  });
+  print(kind, size, "matchlen", time / matched, "cycles/byte");
+  print(kind, size, "matchlen", time / searches, "cycles/call");
+
+  time = measure(3, [&] {
+    for (size_t i = 0; i < scans.size(); ++i) {
+      sink = compare_pattern(len[i] / 2, &target[scans[i]],
+                             static_cast<int32_t>(target.size()) - scans[i],
+                             source.data(), n, pos[i]);
+    }
+  });
+  print(kind, size, "compare_pattern", time / (matched / 2), "cycles/byte");
+  print(kind, size, "compare_pattern", time / searches, "cycles/call");
+  (void)sink;
+}
+
+///
+/// \brief Measure one producer and one consumer passing integers
+/// \return Cycles per element
+///
+template <typename queue>
+double queue_throughput(queue &q, uint64_t items) {
+  uint64_t time = measure(1, [&] {
+    std::thread producer([&] {
+      for (uint64_t i = 0; i < items; ++i) q.push(i);
+      q.close();
+    });
+    uint64_t value;
+    uint64_t sum = 0;
+    while (q.wait_and_pop(value)) sum += value;
+    producer.join();
+    if (sum != items * (items - 1) / 2) std::printf("WRONG RESULT\n");
+  });
+  return static_cast<double>(time) / items;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  // Size in KiB, then kinds of data
+  size_t size = argc > 1 ? std::strtoull(argv[1], nullptr, 10) * 1024
+                         : 16 * 1024 * 1024;
+  const std::vector<std::string> known_kinds = {"random", "low-entropy",
+                                                "repetitive", "executable"};
+  std::vector<std::string> kinds = known_kinds;
+  if (argc > 2) kinds.assign(argv + 2, argv + argc);
+  for (const auto &kind : kinds) {
+    if (std::find(known_kinds.begin(), known_kinds.end(), kind) ==
+        known_kinds.end()) {
+      std::fprintf(stderr, "Unknown kind of data: %s\n", kind.c_str());
+      return 1;
+    }
+  }
+  // Searches start at random positions before the last batch
+  if (size <= andiff_search_batch) {
+    std::fprintf(stderr, "Size has to be at least 1 KiB\n");
+    return 1;
+  }
+
+#if defined(__x86_64__) || defined(__i386__)
+  std::printf("Cycles of time stamp counter\n");
+#else
+  std::printf("Cycles are nanoseconds, no time stamp counter\n");
+#endif
+  uint32_t threads = std::max(1u, std::thread::hardware_concurrency());
+  for (const auto &kind : kinds) run(kind, size, threads);
+
+  const uint64_t items = 4 * 1024 * 1024;
+  synchronized_queue<uint64_t> locked;
+  std::printf("%-42s %10.2f cycles/element\n", "synchronized_queue",
+              queue_throughput(locked, items));
+  spsc_queue<uint64_t> lock_free;
+  std::printf("%-42s %10.2f cycles/element\n", "spsc_queue",
+              queue_throughput(lock_free, items));
+  return 0;
+}
@@ -28,61 +28,239 @@
 
 #include "andiff.hpp"
 
+#include <memory>
+#include <sstream>
+
+#include <getopt.h>
+
+static void usage(const char *name) {
+  std::cerr << "Usage: " << name
+            << " [options] oldfile newfile patchfile [newfile patchfile ...]\n"
+            << "Every new file is compared with the same old file.\n"
+            << "Options:\n"
+            << "  --lcp          Use LCP array to speed up search\n"
+            << "  --fm           Search in FM-index, smaller index\n"
+            << "  --hash         Find only whole blocks, fast and small\n"
+            << "  --codec=NAME   Codec of all sections: none, bzip2, zlib, xz\n"
+            << "  --codec=C,D,E  Codecs of control, diff and extra sections\n"
+            << "  --threads=N    Number of comparison threads\n"
+            << "  --queue-memory=MB  Memory for records waiting to be saved\n"
+            << "  --index=FILE   Reuse index of old file, build it if needed\n"
+            << "  --prefix-bytes=N  Bytes of suffix prefix table, 1 to 3\n"
+            << "  --sa-builder=NAME  Suffix array: divsufsort, parallel\n"
+            << "  --index-bytes=N  Bytes of suffix array entries: 4, 5 or 8\n"
+            << "  --memory-limit=MB  Build and search suffix array on disk\n"
+            << "  --temp-dir=DIR  Temporary files of --memory-limit\n"
+            << std::endl;
+}
+
+///
+/// \brief Parse value of --codec option
+/// \param arg One codec name or three comma separated names
+/// \return Codec of every section
+///
+static std::array<codec_id, 3> parse_codecs(const std::string &arg) {
+  std::vector<codec_id> ids;
+  std::istringstream names(arg);
+  std::string name;
+  while (std::getline(names, name, ',')) {
+    ids.push_back(codec_from_name(name));
+    make_codec(ids.back());  // Throws when codec is not compiled in
+  }
+
+  std::array<codec_id, 3> codecs;
+  if (ids.size() == 1) {
+    codecs.fill(ids[0]);
+  } else if (ids.size() == codecs.size()) {
+    std::copy(ids.begin(), ids.end(), codecs.begin());
+  } else {
+    throw std::invalid_argument("--codec expects one or three codecs");
+  }
+  return codecs;
+}
+
+///
+/// \brief Run comparison with index type of given size
+/// \param bytes   Size of index type: 4, 5 or 8
+/// \param name    Search method printed after bits of index type
+/// \param source  Old file
+/// \param targets New files with their writers
+/// \param options Options of comparison
+///
+template <template <typename, typename> class diff_class>
+static void run_diff(uint32_t bytes, const char *name, data_view source,
+                     const std::vector<diff_target> &targets,
+                     const diff_options &options) {
+  switch (bytes) {
+    case 4:
+      std::cout << "32" << name << std::endl;
+      andiff_runner<diff_class, int32_t>(source, targets, options);
+      break;
+    case 5:
+      std::cout << "40" << name << std::endl;
+      andiff_runner<diff_class, int40_t>(source, targets, options);
+      break;
+    default:
+      std::cout << "64" << name << std::endl;
+      andiff_runner<diff_class, int64_t>(source, targets, options);
+  }
+}
+
 int main(int argc, char *argv[]) {
   try {
-    /// @todo Missing cmd paring
-    if (argc < 4) {
-      std::cerr << "Usage: " << argv[0] << " oldfile newfile patchfile\n"
-                << std::endl;
-      exit(1);
-    }
-
     bool is_lcp = false;
+    bool is_fm = false;
+    bool is_hash = false;
+    uint32_t index_bytes = 0;  // Chosen by size of files when not set
+    std::array<codec_id, 3> codecs;
+    codecs.fill(codec_id::bzip2);
+    diff_options options;
 
-    /// @todo This is stupid, but in some cases may even works
-    if (argc >= 5 && std::string(argv[4]) == "--lcp") {
-      is_lcp = true;
+    static const option long_options[] = {{"lcp", no_argument, nullptr, 'l'},
+                                          {"fm", no_argument, nullptr, 'f'},
+                                          {"hash", no_argument, nullptr, 'h'},
+                                          {"codec", required_argument, nullptr,
+                                           'c'},
+                                          {"threads", required_argument,
+                                           nullptr, 't'},
+                                          {"queue-memory", required_argument,
+                                           nullptr, 'm'},
+                                          {"index", required_argument, nullptr,
+                                           'i'},
+                                          {"prefix-bytes", required_argument,
+                                           nullptr, 'p'},
+                                          {"sa-builder", required_argument,
+                                           nullptr, 's'},
+                                          {"index-bytes", required_argument,
+                                           nullptr, 'b'},
+                                          {"memory-limit", required_argument,
+                                           nullptr, 'M'},
+                                          {"temp-dir", required_argument,
+                                           nullptr, 'd'},
+                                          {nullptr, 0, nullptr, 0}};
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+      switch (opt) {
+        case 'l':
+          is_lcp = true;
+          break;
+        case 'f':
+          is_fm = true;
+          break;
+        case 'h':
+          is_hash = true;
+          break;
+        case 'c':
+          codecs = parse_codecs(optarg);
+          break;
+        case 't':
+          options.threads_number = static_cast<uint32_t>(std::stoul(optarg));
+          enforce(options.threads_number > 0,
+                  "--threads expects positive number");
+          break;
+        case 'm':
+          options.queue_memory = std::stoull(optarg) * 1024 * 1024;
+          break;
+        case 'i':
+          options.index_path = optarg;
+          break;
+        case 'p':
+          options.prefix_bytes = static_cast<uint32_t>(std::stoul(optarg));
+          enforce(options.prefix_bytes >= 1 &&
+                      options.prefix_bytes <= andiff_max_prefix_bytes,
+                  "--prefix-bytes expects number from 1 to 3");
+          break;
+        case 's':
+          options.sa_builder = sa_builder_from_name(optarg);
+          break;
+        case 'b':
+          index_bytes = static_cast<uint32_t>(std::stoul(optarg));
+          enforce(index_bytes == 4 || index_bytes == 5 || index_bytes == 8,
+                  "--index-bytes expects 4, 5 or 8");
+          break;
+        case 'M':
+          options.memory_limit = std::stoull(optarg) * 1024 * 1024;
+          enforce(options.memory_limit > 0,
+                  "--memory-limit expects positive number");
+          break;
+        case 'd':
+          options.temp_dir = optarg;
+          break;
+        default:
+          usage(argv[0]);
+          exit(1);
+      }
     }
 
-    file_reader source_file;
-    source_file.open(argv[1]);
-    ssize_t source_size = source_file.size();
-    std::vector<uint8_t> source(source_size);
-    source_file.read(source.data(), source_size);
-    source_file.close();
+    // Old file followed by pairs of new file and patch file
+    if (argc - optind < 3 || (argc - optind) % 2 != 1) {
+      usage(argv[0]);
+      exit(1);
+    }
+    const char *old_path = argv[optind];
 
-    file_reader target_file;
-    target_file.open(argv[2]);
-    ssize_t target_size = target_file.size();
-    std::vector<uint8_t> target(target_size);
-    target_file.read(target.data(), target_size);
-    target_file.close();
+    // Old file is read sequentially only while suffix array is built, later
+    // the access is random. New file is scanned from the beginning by every
+    // worker.
+    mapped_file source_file(old_path);
+    source_file.advise(MADV_WILLNEED);
+    data_view source = source_file.view();
+    ssize_t source_size = source.size();
 
-    andiff_writer aw;
-    aw.open(argv[3]);
+    thread_pool compress_pool(available_threads());
+    std::vector<mapped_file> target_files;
+    std::vector<std::unique_ptr<andiff_writer>> writers;
+    std::vector<diff_target> targets;
+    ssize_t target_size = 0;  // Size of the largest new file
+    for (int i = optind + 1; i < argc; i += 2) {
+      target_files.emplace_back(argv[i]);
+      target_files.back().advise(MADV_SEQUENTIAL);
+      target_files.back().advise(MADV_WILLNEED);
+      data_view target = target_files.back().view();
+      target_size = std::max<ssize_t>(target_size, target.size());
 
-    // Save magic
-    aw.write_magic(andiff_magic, target_size);
-    aw.open_bz_stream();
+      writers.emplace_back(new andiff_writer(compress_pool, codecs));
+      writers.back()->open(argv[i + 1]);
+      // Save magic
+      writers.back()->write_magic(andiff_magic, target.size());
+      targets.emplace_back(target, writers.back().get());
+    }
 
-    // Use int32_t for all structures when both files are smaller than 2GB.
+    // Use int32_t for all structures when all files are smaller than 2GB.
     // This can save a lot of memory and also speed up computation a bit.
-    if (source_size < std::numeric_limits<int32_t>::max() &&
-        target_size < std::numeric_limits<int32_t>::max()) {
-      if (is_lcp) {
-        std::cout << "32 lcp" << std::endl;
-        andiff_runner<andiff_lcp, int32_t>(source, target, aw);
-      } else {
-        std::cout << "32" << std::endl;
-        andiff_runner<andiff_simple, int32_t>(source, target, aw);
-      }
+    // Files up to 512GB keep index arrays in 5 bytes instead of 8.
+    const ssize_t max_size = std::max(source_size, target_size);
+    uint32_t fitting_bytes = 8;
+    if (max_size < std::numeric_limits<int32_t>::max()) {
+      fitting_bytes = 4;
+    } else if (max_size < int40_max) {
+      fitting_bytes = 5;
+    }
+    if (!index_bytes) index_bytes = fitting_bytes;
+    enforce(index_bytes >= fitting_bytes,
+            "Files are too big for chosen --index-bytes");
+
+    enforce(!options.memory_limit || (!is_hash && !is_lcp),
+            "--memory-limit works only with default search and --fm");
+    if (is_hash) {
+      run_diff<andiff_hash>(index_bytes, " hash", source, targets, options);
+    } else if (is_fm) {
+      run_diff<andiff_fm>(index_bytes, " fm", source, targets, options);
+    } else if (is_lcp) {
+      run_diff<andiff_lcp>(index_bytes, " lcp", source, targets, options);
+    } else if (options.memory_limit) {
+      enforce(options.index_path.empty(),
+              "--memory-limit cannot be used with --index without --fm");
+      run_diff<andiff_external>(index_bytes, " external", source, targets,
+                                options);
     } else {
-      /// @todo add lcp support
-      std::cout << "64" << std::endl;
-      andiff_runner<andiff_simple, int64_t>(source, target, aw);
+      run_diff<andiff_simple>(index_bytes, "", source, targets, options);
+    }
+    // If exception has been thrown output files won't be closed, but this
+    // is not a big problem because OS will do that
+    for (auto &writer : writers) {
+      writer->close();
     }
-    aw.close();  // If exception has been thrown output file won't be closed,
-                 // but this is not a big problem because OS will do that
 
   } catch (std::bad_alloc &e) {
     std::cerr << "Cannot allocate memory: " << e.what() << std::endl;
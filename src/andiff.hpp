@@ -32,14 +32,34 @@
 #include "andiff_lcp.hpp"
 #include "andiff_private.hpp"
 #include "enforce.hpp"
+#include "external_sa.hpp"
+#include "fm_index.hpp"
+#include "hash_index.hpp"
 #include "generate_sa.hpp"
+#include "index_array.hpp"
+#include "index_file.hpp"
+#include "int40.hpp"
+#include "mapped_file.hpp"
+#include "memory_budget.hpp"
 #include "matchlen.hpp"
+#include "page_cache.hpp"
+#include "prefix_table.hpp"
 #include "readers.hpp"
-#include "synchronized_queue.hpp"
+#include "simd.hpp"
+#include "spsc_queue.hpp"
+#include "thread_pool.hpp"
+#include "work_scheduler.hpp"
 #include "writers.hpp"
 
+#include <array>
 #include <cstdint>
+#include <functional>
 #include <iostream>
+#include <list>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
 #include <vector>
 
 struct diff_meta {
@@ -52,48 +72,95 @@ struct diff_meta {
   int64_t scan;
 };
 
-bool operator==(const diff_meta &a, const diff_meta &b) {
-  return a.ctrl_data == b.ctrl_data && a.diff_data == b.diff_data &&
-         a.extra_data == b.extra_data && a.last_pos == b.last_pos &&
-         a.last_scan == b.last_scan && a.last_offset == b.last_offset &&
-         a.scan == b.scan;
+///
+/// \brief Position in old file after applying diff_meta record
+///
+inline int64_t next_old_position(const diff_meta &dm) {
+  return dm.last_pos + dm.ctrl_data + dm.extra_data;
 }
 
-struct data_range {
-  int64_t start;
-  int64_t end;
-};
+///
+/// \brief Unbounded output of diff, used when the consumer is the producer
+///
+struct diff_meta_list {
+  void push(const diff_meta &dm) { records.push_back(dm); }
+  void close() {}
 
-struct data_package {
-  synchronized_queue<diff_meta> *dmeta;
-  data_range drange;
+  std::vector<diff_meta> records;
 };
 
-template <typename _type, typename _derived, typename _writer>
+template <typename _index, typename _derived, typename _writer>
 class andiff_base {
  public:
+  /// Positions and lengths, elements of packed index types are unpacked
+  using _type = index_value_t<_index>;
+  using scheduler = work_scheduler<_type, spsc_queue<diff_meta>>;
+  using block = typename scheduler::block;
+
   ///
-  /// \brief Base class responsible for generating patch
+  /// \brief Base class responsible for generating patches
   /// \param source Old file
+  /// \param threads_number Numbers of threads used for computations
+  ///
+  andiff_base(data_view source, uint32_t threads_number);
+
+  ///
+  /// \brief Add new file to compare with old file
   /// \param target New file
   /// \param writer File writer which inherits from base_data_writer
-  /// \param threads_number Numbers of threads used for computations
   ///
-  andiff_base(const std::vector<uint8_t> &source,
-              const std::vector<uint8_t> &target, _writer writer,
-              uint32_t threads_number);
+  void add_target(data_view target, _writer &writer);
+
   ///
   /// \brief Main method, start comparison
+  /// Search structures are prepared once and shared by all targets.
   ///
   void run();
 
- protected:
   ///
-  /// \brief Target size getter
-  /// \return Size of new/target file
+  /// \brief Limit memory of records waiting for save thread
+  /// Workers wait when the limit is reached, except the one whose records
+  /// are being saved.
+  /// \param bytes Limit in bytes
   ///
-  inline _type get_target_size() const;
+  void set_queue_memory(size_t bytes);
 
+  ///
+  /// \brief Keep suffix array and other search structures in a file
+  /// Valid index is mapped instead of being built. Missing or stale index
+  /// is built and written to the file.
+  /// \param file_path Path to index file
+  ///
+  void set_index_file(const std::string &file_path);
+
+  ///
+  /// \brief Choose algorithm which builds suffix array
+  /// \param builder Builder, divsufsort by default
+  ///
+  void set_sa_builder(sa_builder_id builder);
+
+  /// Derived classes which search without suffix array hide it with false
+  static constexpr bool stores_suffix_array = true;
+
+  ///
+  /// \brief Search consecutive positions of target
+  /// Derived classes can hide it with a version which overlaps memory
+  /// accesses of the searches.
+  /// \param target Target/new file
+  /// \param scan   First position, at most andiff_search_batch follow it
+  /// \param count  Number of positions
+  /// \param len    Output lengths of matches
+  /// \param pos    Output positions of matches
+  ///
+  void search_batch(data_view target, _type scan, size_t count, _type *len,
+                    _type *pos) const {
+    for (size_t j = 0; j < count; ++j) {
+      len[j] = static_cast<const _derived *>(this)->search(
+          target, scan + static_cast<_type>(j), pos[j]);
+    }
+  }
+
+ protected:
   ///
   /// \brief Source size getter
   /// \return Size of old/source file
@@ -101,261 +168,482 @@ class andiff_base {
   inline _type get_source_size() const;
 
  private:
+  ///
+  /// \brief New file with its patch and work split between workers
+  ///
+  struct diff_job {
+    diff_job(data_view job_target, _writer &job_writer, uint32_t workers,
+             _type min_split, memory_budget *budget)
+        : target(job_target),
+          writer(job_writer),
+          sched(static_cast<_type>(job_target.size()), workers, min_split,
+                budget) {}
+
+    const data_view target;  ///< Target/new file
+    _writer &writer;         ///< Writer of patch of this target
+    scheduler sched;         ///< Ranges of this target
+  };
+
   ///
   /// \brief Precompute data required to main comparison like suffix array
   ///
   void prepare();
 
   ///
-  /// \brief Helper method for andiff_base::diff method
-  /// \param dpackage Queue with ranges to compare
+  /// \brief Build suffix array and structures of derived class
   ///
-  void process(synchronized_queue<data_package> &dpackage);
+  void build_index();
+
+  ///
+  /// \brief Worker thread, compares own range and then steals work
+  /// Targets are processed in order, worker moves to the next one when
+  /// nothing is left to steal.
+  /// \param jobs   Jobs shared by workers
+  /// \param worker Worker index
+  ///
+  void process(std::list<diff_job> &jobs, uint32_t worker);
 
   ///
   /// \brief Main diff method
-  /// \param meta_data  Output queue for computed data
-  /// \param start      Beginning of comparison
-  /// \param end        End of comparison
+  /// \param target     Target/new file
+  /// \param range      Range to compare, results go to its output queue
   /// \param lastscan   Last scanned position
   /// \param lastpos    Last position
   /// \param lastoffset Last offset
   ///
-  void diff(synchronized_queue<diff_meta> &meta_data, _type start, _type end,
-            _type lastscan, _type lastpos = 0, _type lastoffset = 0);
+  template <typename _range>
+  void diff(data_view target, _range &range, _type lastscan,
+            _type lastpos = 0, _type lastoffset = 0);
+
+  ///
+  /// \brief Generate and save records from the end of saved data
+  /// \param job           Job which is saved
+  /// \param save_buffer   Helper buffer to transform data
+  /// \param dm_old        Last saved record, updated
+  /// \param next_position End of saved data, updated
+  /// \param end           Stop after passing this position
+  ///
+  void repair(diff_job &job, std::vector<uint8_t> &save_buffer,
+              diff_meta &dm_old, int64_t &next_position, _type end);
 
   ///
   /// \brief Transform processed block and save to file
+  /// \param job         Job which is saved
   /// \param save_buffer Helper buffer to transform data
   /// \param dm          Diff data to be saved
   /// \return Position of next processed block
   ///
-  int64_t save_helper(std::vector<uint8_t> &save_buffer, const diff_meta &dm);
+  int64_t save_helper(diff_job &job, std::vector<uint8_t> &save_buffer,
+                      const diff_meta &dm);
 
-  void save(std::vector<synchronized_queue<diff_meta>> &meta_data);
+  ///
+  /// \brief Save thread of one job, writes records in target order
+  /// \param job Job to save
+  ///
+  void save(diff_job &job);
 
  protected:
-  std::vector<_type> SA;                 ///< Suffix array
-  const std::vector<uint8_t> &m_source;  ///< Source/old file
-  const std::vector<uint8_t> &m_target;  ///< Target/new file
-  _writer m_writer;  ///< File writer. Right now only Bz2 writer is supported
+  index_array<_index> SA;   ///< Suffix array
+  const data_view m_source;  ///< Source/old file
+  /// New files with writers of their patches
+  std::vector<std::pair<data_view, _writer *>> m_targets;
   const uint32_t m_threads_number;  ///< Number of threads used for processing
+  size_t m_queue_memory;  ///< Memory limit of records waiting for save
+  std::string m_index_path;  ///< Index file, empty when not used
+  index_reader m_index;      ///< Mapped index, arrays can point into it
+  sa_builder_id m_sa_builder = sa_builder_id::divsufsort;
 };
 
-template <typename _type, typename _writer>
+template <typename _index, typename _writer>
 class andiff_simple
-    : public andiff_base<_type, andiff_simple<_type, _writer>, _writer> {
+    : public andiff_base<_index, andiff_simple<_index, _writer>, _writer> {
  public:
-  using base = andiff_base<_type, andiff_simple<_type, _writer>, _writer>;
+  using base = andiff_base<_index, andiff_simple<_index, _writer>, _writer>;
+  using typename base::_type;
   using base::SA;
   using base::m_source;
-  using base::m_target;
-  using base::get_target_size;
 
-  andiff_simple(const std::vector<uint8_t> &source,
-                const std::vector<uint8_t> &target, uint32_t threads_number,
-                _writer &writer);
+  andiff_simple(data_view source, uint32_t threads_number);
+
+  /// Identifies index files built by this class
+  static constexpr uint32_t index_kind = 1;
 
   void prepare_specific();
 
-  inline _type get_letter_range_end(_type new_first_letter) const;
+  void save_index(index_writer &writer) const;
+
+  void load_index(const index_reader &reader);
+
+  ///
+  /// \brief Set number of bytes of suffixes sorted by prefix table
+  /// Index file keeps the number it was built with.
+  /// \param bytes From 1 up to andiff_max_prefix_bytes
+  ///
+  void set_prefix_bytes(uint32_t bytes);
+
+  inline _type search(data_view target, _type scan, _type &pos) const;
 
-  inline _type search(_type scan, _type &pos) const;
+  ///
+  /// \brief Interleaved search of consecutive positions
+  /// \copydetails andiff_base::search_batch
+  ///
+  void search_batch(data_view target, _type scan, size_t count, _type *len,
+                    _type *pos) const;
 
  private:
-  _type dict_array[256] = {0};
+  prefix_table<_index> m_prefix_table;
 };
 
 /////////// Helper functions ///////////
 
+///
+/// \brief One step of search_simple, compare target with middle row
+/// \param range   Searched range, halved
+/// \param mid     Middle row of range
+/// \param mid_sa  Suffix array value of middle row
+/// \param source  Array where we look for pattern
+/// \param target  Array with pattern to find
+/// \param newsize Max size of pattern to find
+///
+template <typename T>
+inline void search_simple_step(simple_range<T> &range, T mid, T mid_sa,
+                               data_view source, const uint8_t *target,
+                               T newsize) {
+  const uint8_t *old_start = source.data() + mid_sa;
+  T cmp_min = std::min(static_cast<T>(source.size()) - mid_sa, newsize);
+  T i = std::min(range.lmin, range.rmin);
+  if (i < cmp_min) {
+    i += static_cast<T>(find_mismatch(old_start + i, target + i,
+                                      static_cast<size_t>(cmp_min - i)));
+  }
+
+  if (i < cmp_min) {
+    if (old_start[i] < target[i]) {  // move right
+      range.lpos = mid;
+      range.lmin = i;
+    } else {
+      range.rpos = mid;
+      range.rmin = i;
+    }
+  } else {
+    // Old suffix shorter than known bytes was matched only by padding
+    range.rpos = mid;
+    range.rmin = cmp_min;
+  }
+}
+
+///
+/// \brief Longer match of the two rows left by search_simple
+///
+template <typename T, typename array>
+inline T search_simple_result(const array &SA, data_view source,
+                              const uint8_t *target, T newsize,
+                              const simple_range<T> &range, T *pos) {
+  const T oldsize = static_cast<T>(source.size());
+  const T rsa = SA[range.rpos];
+  const T lsa = SA[range.lpos];
+  T rlen = matchlen(source.data() + rsa, oldsize - rsa, target, newsize);
+  T llen = matchlen(source.data() + lsa, oldsize - lsa, target, newsize);
+  *pos = rlen >= llen ? rsa : lsa;
+  return std::max(rlen, llen);
+}
+
 ///
 /// \brief Simple version of binary search. It looks for common string in both
 ///        arrays.
-/// \param SA      Suffix array calculated from source array
+/// \param SA      Suffix array calculated from source array, index_array or
+///                other array with operator[], its index type can be packed
 /// \param source  Array where we look for pattern
 /// \param target  Array with pattern to find
 /// \param newsize Max size of pattern to find
 /// \param pos     Output position when find a match
-/// \param start   Where to start search
-/// \param end     End of source array
+/// \param range   Rows to search and bytes known to match
 /// \return Length of common string in both arrays
 ///
-template <typename T>
-static T search_simple(const std::vector<T> &SA,
-                       const std::vector<uint8_t> &source,
-                       const uint8_t *target, T newsize, T *pos, T start,
-                       T end) {
-  T lpos = start;
-  T rpos = start + end;
-  T lmin = 1;
-  T rmin = 1;
-  T oldsize = static_cast<T>(source.size());
-
-  while (rpos - lpos > 1) {
-    T mid = lpos + (rpos - lpos) / 2;
-
-    const uint8_t *old_start = source.data() + SA[mid];
-    T cmp_min = std::min(oldsize - SA[mid], newsize);
-    T i = std::min(lmin, rmin);
-
-    for (; i < cmp_min; ++i) {
-      if (old_start[i] < target[i]) {  // move right
-        lpos = mid;
-        lmin = i;
-        break;
-      } else if (old_start[i] > target[i]) {
-        rpos = mid;
-        rmin = i;
-        break;
-      }
-    }
+template <typename T, typename array>
+static T search_simple(const array &SA, data_view source,
+                       const uint8_t *target, T newsize, T *pos,
+                       simple_range<T> range) {
+  while (range.rpos - range.lpos > 1) {
+    T mid = range.lpos + (range.rpos - range.lpos) / 2;
+    search_simple_step(range, mid, static_cast<T>(SA[mid]), source, target,
+                       newsize);
+  }
+  return search_simple_result(SA, source, target, newsize, range, pos);
+}
 
-    if (i == cmp_min) {
-      rpos = mid;
-      rmin = i;
+///
+/// \brief search_simple of consecutive positions of target at once
+/// Steps of all searches are interleaved. Every round first prefetches
+/// middle rows of suffix array, then old file data they point to, and
+/// only then compares, so misses of all searches overlap.
+/// \param SA      Suffix array calculated from source array
+/// \param source  Array where we look for pattern
+/// \param target  Pattern of the first search, next ones start at
+///                 following bytes
+/// \param newsize Max size of pattern of the first search
+/// \param ranges  Ranges of searches, at most andiff_search_batch
+/// \param count   Number of searches
+/// \param len     Output lengths of matches
+/// \param pos     Output positions of matches
+///
+template <typename T, typename array>
+static void search_simple_batch(const array &SA, data_view source,
+                                const uint8_t *target, T newsize,
+                                simple_range<T> *ranges, size_t count,
+                                T *len, T *pos) {
+  const T oldsize = static_cast<T>(source.size());
+  std::array<T, andiff_search_batch> mids;
+  bool active = true;
+  while (active) {
+    for (size_t j = 0; j < count; ++j) {
+      const simple_range<T> &range = ranges[j];
+      if (range.rpos - range.lpos <= 1) continue;
+      mids[j] = range.lpos + (range.rpos - range.lpos) / 2;
+      SA.prefetch(static_cast<size_t>(mids[j]));
+    }
+    for (size_t j = 0; j < count; ++j) {
+      const simple_range<T> &range = ranges[j];
+      if (range.rpos - range.lpos <= 1) continue;
+      T mid_sa = SA[mids[j]];
+      T first = std::min(std::min(range.lmin, range.rmin), oldsize - mid_sa);
+      __builtin_prefetch(source.data() + mid_sa + first);
     }
+    active = false;
+    for (size_t j = 0; j < count; ++j) {
+      simple_range<T> &range = ranges[j];
+      if (range.rpos - range.lpos <= 1) continue;
+      search_simple_step(range, mids[j], static_cast<T>(SA[mids[j]]), source,
+                         target + j, newsize - static_cast<T>(j));
+      active = active || range.rpos - range.lpos > 1;
+    }
+  }
+  for (size_t j = 0; j < count; ++j) {
+    len[j] = search_simple_result(SA, source, target + j,
+                                  newsize - static_cast<T>(j), ranges[j],
+                                  &pos[j]);
   }
+}
 
-  T rlen =
-      matchlen(source.data() + SA[rpos], oldsize - SA[rpos], target, newsize);
-  T llen =
-      matchlen(source.data() + SA[lpos], oldsize - SA[lpos], target, newsize);
-  *pos = SA[rlen >= llen ? rpos : lpos];
-  return std::max(rlen, llen);
+///
+/// \brief search_simple of target at scan from its prefix table bucket
+/// \param SA     Suffix array of source
+/// \param table  Prefix table of SA
+/// \param source Old file
+/// \param target New file
+/// \param scan   Searched position of target
+/// \param pos    Output position of match
+/// \return Length of match
+///
+template <typename T, typename array, typename I>
+inline T search_bucket(const array &SA, const prefix_table<I> &table,
+                       data_view source, data_view target, T scan, T *pos) {
+  const T size = static_cast<T>(target.size()) - scan;
+  return search_simple(
+      SA, source, &target[scan], size, pos,
+      table.bucket(&target[scan], size, static_cast<T>(source.size())));
 }
 
 ///
-/// \brief Convert int64_t to array of uint8_t
-/// \param x Value to convert
-/// \param buf Output buffer
+/// \brief search_bucket of consecutive positions at once
+/// \copydetails search_simple_batch
 ///
-static void offtout(int64_t x, uint8_t *buf) {
-  int64_t y;
+template <typename T, typename array, typename I>
+inline void search_bucket_batch(const array &SA, const prefix_table<I> &table,
+                                data_view source, data_view target, T scan,
+                                size_t count, T *len, T *pos) {
+  const T size = static_cast<T>(target.size()) - scan;
+  std::array<simple_range<T>, andiff_search_batch> ranges;
+  for (size_t j = 0; j < count; ++j) {
+    ranges[j] = table.bucket(&target[scan + j], size - static_cast<T>(j),
+                             static_cast<T>(source.size()));
+  }
+  search_simple_batch(SA, source, &target[scan], size, ranges.data(), count,
+                      len, pos);
+}
 
-  if (x < 0)
-    y = -x;
-  else
-    y = x;
+////////// andiff_base implementation //////////
 
-  *reinterpret_cast<int64_t *>(buf) = y;
+template <typename _index, typename _derived, typename _writer>
+andiff_base<_index, _derived, _writer>::andiff_base(data_view source,
+                                                   uint32_t threads_number)
+    : m_source(source),
+      m_threads_number(threads_number),
+      m_queue_memory(andiff_default_queue_memory) {}
+
+template <typename _index, typename _derived, typename _writer>
+void andiff_base<_index, _derived, _writer>::add_target(data_view target,
+                                                       _writer &writer) {
+  m_targets.emplace_back(target, &writer);
+}
 
-  if (x < 0) buf[7] |= 0x80;
+template <typename _index, typename _derived, typename _writer>
+void andiff_base<_index, _derived, _writer>::set_queue_memory(size_t bytes) {
+  m_queue_memory = bytes;
+}
 
-  return;
+template <typename _index, typename _derived, typename _writer>
+void andiff_base<_index, _derived, _writer>::set_index_file(
+    const std::string &file_path) {
+  m_index_path = file_path;
 }
 
-////////// andiff_base implementation //////////
+template <typename _index, typename _derived, typename _writer>
+void andiff_base<_index, _derived, _writer>::set_sa_builder(
+    sa_builder_id builder) {
+  m_sa_builder = builder;
+}
 
-template <typename _type, typename _derived, typename _writer>
-andiff_base<_type, _derived, _writer>::andiff_base(
-    const std::vector<uint8_t> &source, const std::vector<uint8_t> &target,
-    _writer writer, uint32_t threads_number)
-    : SA(source.size() + 1),
-      m_source(source),
-      m_target(target),
-      m_writer(writer),
-      m_threads_number(threads_number) {}
-
-template <typename _type, typename _derived, typename _writer>
-void andiff_base<_type, _derived, _writer>::run() {
+template <typename _index, typename _derived, typename _writer>
+void andiff_base<_index, _derived, _writer>::run() {
   prepare();
   uint32_t threads_number = m_threads_number;
   std::vector<std::thread> threads(threads_number);
   std::cout << "Comparison has been started using " << threads_number
             << " threads\n";
 
-  const _type block_size = std::min<_type>(
-      2 * 1024 * 1024, (get_target_size() + 1) / threads_number);
-  uint64_t iterations = get_target_size() / block_size;
-  std::vector<synchronized_queue<diff_meta>> meta_data(iterations);
-  std::thread save_thread(
-      std::bind(&andiff_base::save, this, std::ref(meta_data)));
-
-  synchronized_queue<data_package> data_queue;
-  _type range_start = 0;
-  _type range_end = block_size;
-  uint64_t iter = 0;
-
-  for (; iter < iterations - 1; ++iter) {
-    data_range dr = {range_start, range_end};
-    data_package dp = {&(meta_data[iter]), dr};
-    data_queue.push(dp);
-    range_start = range_end;
-    range_end += block_size;
-  }
-  data_range dr = {range_start, get_target_size()};
-  data_package dp = {&(meta_data[iter]), dr};
-  data_queue.push(dp);
+  // Ranges are split further when workers run out of work, into halves of
+  // at least min_split, so remaining ranges below 512KB are not split
+  const _type min_split = 256 * 1024;
+  // Records of all targets share one limit
+  memory_budget queue_budget(m_queue_memory);
+  std::list<diff_job> jobs;
+  std::vector<std::thread> save_threads;
+  for (const auto &target : m_targets) {
+    jobs.emplace_back(target.first, *target.second, threads_number, min_split,
+                      &queue_budget);
+    save_threads.emplace_back(
+        std::bind(&andiff_base::save, this, std::ref(jobs.back())));
+  }
 
   for (uint32_t i = 0; i < threads_number; ++i) {
-    threads[i] = std::thread(&andiff_base::process, this, std::ref(data_queue));
+    threads[i] = std::thread(&andiff_base::process, this, std::ref(jobs), i);
   }
-  data_queue.close();
 
   for (uint32_t i = 0; i < threads_number; ++i) {
     threads[i].join();
   }
-  save_thread.join();
+  for (auto &save_thread : save_threads) {
+    save_thread.join();
+  }
 }
 
-template <typename _type, typename _derived, typename _writer>
-_type andiff_base<_type, _derived, _writer>::get_target_size() const {
-  return static_cast<_type>(m_target.size());
+template <typename _index, typename _derived, typename _writer>
+typename andiff_base<_index, _derived, _writer>::_type
+andiff_base<_index, _derived, _writer>::get_source_size() const {
+  return static_cast<_type>(m_source.size());
 }
 
-template <typename _type, typename _derived, typename _writer>
-_type andiff_base<_type, _derived, _writer>::get_source_size() const {
-  return static_cast<_type>(m_source.size());
+template <typename _index, typename _derived, typename _writer>
+void andiff_base<_index, _derived, _writer>::prepare() {
+  // Nothing to search in, whole target goes to extra data
+  if (m_source.empty()) return;
+
+  if (m_index_path.empty()) {
+    build_index();
+    return;
+  }
+
+  const uint32_t kind = _derived::index_kind;
+  const uint64_t source_checksum =
+      checksum64(m_source.data(), m_source.size());
+  if (m_index.open(m_index_path, sizeof(_index), kind, m_source.size(),
+                   source_checksum)) {
+    std::cout << "Using index " << m_index_path << std::endl;
+    SA = m_index.template array<_index>(0);
+    enforce(SA.size() == (_derived::stores_suffix_array ? m_source.size() + 1
+                                                        : 0),
+            "Index has wrong size");
+    static_cast<_derived *>(this)->load_index(m_index);
+    return;
+  }
+
+  build_index();
+  index_writer writer(sizeof(_index), kind, m_source.size(), source_checksum);
+  writer.add(SA.data(), SA.size());
+  static_cast<const _derived *>(this)->save_index(writer);
+  writer.write(m_index_path);
 }
 
-template <typename _type, typename _derived, typename _writer>
-void andiff_base<_type, _derived, _writer>::prepare() {
-  int sa_result = generate_suffix_array<_type>(
-      m_source.data(), SA.data(), static_cast<_type>(m_source.size()));
-  enforce(sa_result == 0, "Generating suffix array failed");
+template <typename _index, typename _derived, typename _writer>
+void andiff_base<_index, _derived, _writer>::build_index() {
+  if (_derived::stores_suffix_array) {
+    SA = make_suffix_array<_index>(m_sa_builder, m_source.data(),
+                                   m_source.size(), m_threads_number);
+  }
 
   static_cast<_derived *>(this)->prepare_specific();
 }
 
-template <typename _type, typename _derived, typename _writer>
-void andiff_base<_type, _derived, _writer>::process(
-    synchronized_queue<data_package> &dpackage) {
-  data_package dp;
-  while (dpackage.wait_and_pop(dp)) {
-    andiff_base::diff(*(dp.dmeta), dp.drange.start, dp.drange.end,
-                      dp.drange.start);
+template <typename _index, typename _derived, typename _writer>
+void andiff_base<_index, _derived, _writer>::process(
+    std::list<diff_job> &jobs, uint32_t worker) {
+  for (auto &job : jobs) {
+    block *range = job.sched.initial(worker);
+    if (!range) range = job.sched.steal();
+    while (range) {
+      diff(job.target, *range, range->start);
+      job.sched.finish(range);
+      range = job.sched.steal();
+    }
   }
 }
 
-template <typename _type, typename _derived, typename _writer>
-void andiff_base<_type, _derived, _writer>::diff(
-    synchronized_queue<diff_meta> &meta_data, _type start, _type end,
-    _type lastscan, _type lastpos, _type lastoffset) {
+template <typename _index, typename _derived, typename _writer>
+template <typename _range>
+void andiff_base<_index, _derived, _writer>::diff(data_view target,
+                                                 _range &range, _type lastscan,
+                                                 _type lastpos,
+                                                 _type lastoffset) {
   _type scan, pos, len;
   _type oldscore, scsc;
 
-  const _type tsize = get_target_size();
+  const _type tsize = static_cast<_type>(target.size());
   const _type ssize = get_source_size();
 
-  scan = start;
+  scan = range.start;
   len = 0;
   pos = 0;
 
+  // Results of searches ahead of scan. Window doubles while scan moves by
+  // one byte and starts again from one position after a jump.
+  std::array<_type, andiff_search_batch> batch_len;
+  std::array<_type, andiff_search_batch> batch_pos;
+  _type batch_start = 0;
+  _type batch_count = 0;
+  _type batch_size = 1;
+
   while (scan < tsize) {
     oldscore = 0;
 
     for (scsc = scan += len; scan < tsize; ++scan) {
-      len = static_cast<_derived *>(this)->search(scan, pos);
+      if (!ssize) {
+        len = 0;
+      } else {
+        if (scan < batch_start || scan >= batch_start + batch_count) {
+          batch_size = scan == batch_start + batch_count
+                           ? std::min<_type>(2 * batch_size,
+                                             andiff_search_batch)
+                           : 1;
+          batch_start = scan;
+          batch_count = std::min(batch_size, tsize - scan);
+          static_cast<_derived *>(this)->search_batch(
+              target, scan, static_cast<size_t>(batch_count),
+              batch_len.data(), batch_pos.data());
+        }
+        len = batch_len[scan - batch_start];
+        pos = batch_pos[scan - batch_start];
+      }
 
       for (; scsc < scan + len; scsc++)
         if ((scsc + lastoffset < ssize) &&
-            (m_source[scsc + lastoffset] == m_target[scsc]))
+            (m_source[scsc + lastoffset] == target[scsc]))
           oldscore++;
 
       if (((len == oldscore) && (len != 0)) || (len > oldscore + 8)) break;
 
       if ((scan + lastoffset < ssize) &&
-          (m_source[scan + lastoffset] == m_target[scan]))
+          (m_source[scan + lastoffset] == target[scan]))
         oldscore--;
     }
 
@@ -364,7 +652,7 @@ void andiff_base<_type, _derived, _writer>::diff(
       _type Sf = 0;
       _type lenf = 0;
       for (_type i = 0; (lastscan + i < scan) && (lastpos + i < ssize);) {
-        if (m_source[lastpos + i] == m_target[lastscan + i]) s++;
+        if (m_source[lastpos + i] == target[lastscan + i]) s++;
         i++;
         if (s * 2 - i > Sf * 2 - lenf) {
           Sf = s;
@@ -377,7 +665,7 @@ void andiff_base<_type, _derived, _writer>::diff(
         s = 0;
         _type Sb = 0;
         for (_type i = 1; (scan >= lastscan + i) && (pos >= i); i++) {
-          if (m_source[pos - i] == m_target[scan - i]) s++;
+          if (m_source[pos - i] == target[scan - i]) s++;
           if (s * 2 - i > Sb * 2 - lenb) {
             Sb = s;
             lenb = i;
@@ -391,10 +679,10 @@ void andiff_base<_type, _derived, _writer>::diff(
         _type Ss = 0;
         _type lens = 0;
         for (_type i = 0; i < overlap; i++) {
-          if (m_target[lastscan + lenf - overlap + i] ==
+          if (target[lastscan + lenf - overlap + i] ==
               m_source[lastpos + lenf - overlap + i])
             s++;
-          if (m_target[scan - lenb + i] == m_source[pos - lenb + i]) s--;
+          if (target[scan - lenb + i] == m_source[pos - lenb + i]) s--;
           if (s > Ss) {
             Ss = s;
             lens = i + 1;
@@ -412,180 +700,415 @@ void andiff_base<_type, _derived, _writer>::diff(
                       lastpos,
                       lastoffset,
                       scan};
-      meta_data.push(dm);
+      range.output.push(dm);
 
       lastoffset = pos - scan;
       lastscan = scan - lenb;
       lastpos = pos - lenb;
 
-      if (lastscan > end) {
+      range.progress.store(lastscan, std::memory_order_relaxed);
+      if (lastscan > range.end.load(std::memory_order_relaxed)) {
         break;
       }
     }
   }
 
-  meta_data.close();
+  range.output.close();
 }
 
-template <typename _type, typename _derived, typename _writer>
-int64_t andiff_base<_type, _derived, _writer>::save_helper(
-    std::vector<uint8_t> &save_buffer, const diff_meta &dm) {
-  std::array<uint8_t, 8 * 3> buf;
-  offtout(dm.ctrl_data, buf.data());
-  offtout(dm.diff_data, buf.data() + 8);
-  offtout(dm.extra_data, buf.data() + 16);
-
-  // Write control data
-  m_writer.write(buf.data(), buf.size());
+template <typename _index, typename _derived, typename _writer>
+int64_t andiff_base<_index, _derived, _writer>::save_helper(
+    diff_job &job, std::vector<uint8_t> &save_buffer, const diff_meta &dm) {
+  job.writer.write_control(dm.ctrl_data, dm.diff_data, dm.extra_data);
 
   int64_t already_written_diff = 0;
   while (already_written_diff != dm.ctrl_data) {
     int64_t to_write = std::min<int64_t>(dm.ctrl_data - already_written_diff,
                                          save_buffer.size());
     // Write diff data
-    for (int64_t i = 0; i < to_write; i++)
-      save_buffer[i] = m_target[dm.last_scan + already_written_diff + i] -
-                       m_source[dm.last_pos + already_written_diff + i];
+    subtract_bytes(save_buffer.data(),
+                   job.target.data() + dm.last_scan + already_written_diff,
+                   m_source.data() + dm.last_pos + already_written_diff,
+                   static_cast<size_t>(to_write));
 
-    m_writer.write(save_buffer.data(), to_write);
+    job.writer.write_diff(save_buffer.data(), to_write);
     already_written_diff += to_write;
   }
 
-  int64_t already_written_data = 0;
-  while (already_written_data != dm.diff_data) {
-    int64_t to_write = std::min<int64_t>(dm.diff_data - already_written_data,
-                                         save_buffer.size());
-    // Write extra data
-    for (int64_t i = 0; i < to_write; i++)
-      save_buffer[i] =
-          m_target[dm.last_scan + dm.ctrl_data + already_written_data + i];
-    m_writer.write(save_buffer.data(), to_write);
-    already_written_data += to_write;
-  }
+  // Write extra data, it is copied directly from target
+  job.writer.write_extra(job.target.data() + dm.last_scan + dm.ctrl_data,
+                       dm.diff_data);
 
   int64_t next_position = dm.ctrl_data + dm.diff_data + dm.last_scan;
   return next_position;
 }
 
-template <typename _type, typename _derived, typename _writer>
-void andiff_base<_type, _derived, _writer>::save(
-    std::vector<synchronized_queue<diff_meta>> &meta_data) {
-  // Allocate array of output size or 16MB
-  // (I think that 16 is as good as 8 and 32 megs)
-  const uint64_t block_size = std::min(m_target.size() + 1, 16UL * 1024 * 1024);
+template <typename _index, typename _derived, typename _writer>
+void andiff_base<_index, _derived, _writer>::repair(
+    diff_job &job, std::vector<uint8_t> &save_buffer, diff_meta &dm_old,
+    int64_t &next_position, _type end) {
+  // Continue exactly where saved data ends, so every generated record
+  // follows the previous one in both files
+  const int64_t old_position = next_old_position(dm_old);
+  // Records are consumed by this thread, so output cannot be bounded
+  work_block<_type, diff_meta_list> range(static_cast<_type>(dm_old.scan),
+                                          end);
+  diff(job.target, range, static_cast<_type>(next_position),
+       static_cast<_type>(old_position),
+       static_cast<_type>(old_position - next_position));
+
+  for (const auto &dm : range.output.records) {
+    next_position = save_helper(job, save_buffer, dm);
+    dm_old = dm;
+  }
+}
+
+template <typename _index, typename _derived, typename _writer>
+void andiff_base<_index, _derived, _writer>::save(diff_job &job) {
+  // Allocate array of output size or one chunk, every job has its own
+  const uint64_t block_size =
+      std::min<uint64_t>(job.target.size() + 1, andiff_chunk_size);
   std::vector<uint8_t> save_buffer(block_size);
+  std::array<diff_meta, 64> batch;
   diff_meta dm = {};
   int64_t next_position = 0;
 
-  /// @todo What if meta_array has no elements??
-  meta_data[0].wait_and_pop(dm);
-  next_position = save_helper(save_buffer, dm);
+  const _type target_size = static_cast<_type>(job.target.size());
+  block *range = job.sched.first();
+  // Empty target gives no records, then empty control record is saved
+  range->output.wait_and_pop(dm);
+  next_position = save_helper(job, save_buffer, dm);
   diff_meta dm_old = dm;
 
-  for (auto &mdata : meta_data) {
-    while (mdata.wait_and_pop(dm)) {
-      // Check if next block match, if we already have it, skip
+  for (; range; range = job.sched.next(range)) {
+    auto &output = range->output;
+    while (output.wait_and_pop(dm)) {
+      // Already covered by previous blocks, skip
       if (dm.last_scan < next_position) continue;
       // If next is farther than we expected, fill the gap
       if (dm.last_scan > next_position) {
-        synchronized_queue<diff_meta> sdm;
-        // Generate few blocks with "trusted" data
-        diff(sdm, dm_old.scan, dm.last_scan, dm_old.last_scan, dm_old.last_pos,
-             dm_old.last_offset);
-        diff_meta dm1 = {};
-        while (sdm.wait_and_pop(dm1)) {
-          if (dm1.last_scan < next_position) continue;
-          next_position = save_helper(save_buffer, dm1);
-          dm_old = dm1;
-        }
+        repair(job, save_buffer, dm_old, next_position,
+               static_cast<_type>(dm.last_scan - 1));
+      }
+      // Records of this block follow saved data, save the rest of queue
+      if (dm.last_scan == next_position &&
+          dm.last_pos == next_old_position(dm_old)) {
+        next_position = save_helper(job, save_buffer, dm);
+        dm_old = dm;
+        break;
       }
-      // When previous block is the same as current go and save the rest of
-      // queue
-      if (dm_old == dm) break;
     }
 
-    while (mdata.wait_and_pop(dm)) {
-      next_position = save_helper(save_buffer, dm);
-      dm_old = dm;
+    while (size_t count = output.pop_batch(batch.data(), batch.size())) {
+      for (size_t i = 0; i < count; ++i) {
+        next_position = save_helper(job, save_buffer, batch[i]);
+      }
+      dm_old = batch[count - 1];
     }
   }
 
-  enforce(next_position == static_cast<_type>(m_target.size()) ||
-              next_position != 0,
+  // Tail of the last block could be skipped while repairing its beginning
+  if (next_position < target_size) {
+    repair(job, save_buffer, dm_old, next_position, target_size);
+  }
+
+  enforce(next_position == target_size,
           "Not full patch has been generated.");
 }
 
 ////////// andiff_simple //////////
 
-template <typename _type, typename _writer>
-andiff_simple<_type, _writer>::andiff_simple(const std::vector<uint8_t> &source,
-                                             const std::vector<uint8_t> &target,
-                                             uint32_t threads_number,
-                                             _writer &writer)
-    : base(source, target, writer, threads_number) {}
-
-template <typename _type, typename _writer>
-void andiff_simple<_type, _writer>::prepare_specific() {
-  for (uint32_t i = 1; i < 256; ++i) {
-    auto ret = std::lower_bound(
-        SA.begin(), SA.end(), i,
-        [&](const long int &a, const _type &b) { return m_source[a] < b; });
-    dict_array[i] = ret != SA.end() ? std::distance(SA.begin(), ret) - 1
-                                    : dict_array[i - 1];
-  }
+template <typename _index, typename _writer>
+andiff_simple<_index, _writer>::andiff_simple(data_view source,
+                                             uint32_t threads_number)
+    : base(source, threads_number) {}
+
+template <typename _index, typename _writer>
+void andiff_simple<_index, _writer>::set_prefix_bytes(uint32_t bytes) {
+  m_prefix_table.set_bytes(bytes);
+}
+
+template <typename _index, typename _writer>
+void andiff_simple<_index, _writer>::prepare_specific() {
+  m_prefix_table.build(SA, m_source);
+}
+
+template <typename _index, typename _writer>
+void andiff_simple<_index, _writer>::save_index(index_writer &writer) const {
+  m_prefix_table.save(writer);
 }
 
-template <typename _type, typename _writer>
-_type andiff_simple<_type, _writer>::get_letter_range_end(
-    _type new_first_letter) const {
-  return new_first_letter != 255
-             ? dict_array[new_first_letter + 1] - dict_array[new_first_letter]
-             : static_cast<_type>(m_source.size()) - dict_array[255];
+template <typename _index, typename _writer>
+void andiff_simple<_index, _writer>::load_index(const index_reader &reader) {
+  m_prefix_table.load(reader, 1);
 }
 
-template <typename _type, typename _writer>
-_type andiff_simple<_type, _writer>::search(_type scan, _type &pos) const {
-  uint8_t new_first_letter = m_target[scan];
-  return search_simple(SA, m_source, &m_target[scan], get_target_size() - scan,
-                       &pos, dict_array[new_first_letter],
-                       this->get_letter_range_end(new_first_letter));
+template <typename _index, typename _writer>
+typename andiff_simple<_index, _writer>::_type
+andiff_simple<_index, _writer>::search(data_view target, _type scan,
+                                           _type &pos) const {
+  return search_bucket(SA, m_prefix_table, m_source, target, scan, &pos);
 }
 
-template <typename _type, typename _writer>
+template <typename _index, typename _writer>
+void andiff_simple<_index, _writer>::search_batch(data_view target,
+                                                 _type scan, size_t count,
+                                                 _type *len,
+                                                 _type *pos) const {
+  search_bucket_batch(SA, m_prefix_table, m_source, target, scan, count, len,
+                      pos);
+}
+
+template <typename _index, typename _writer>
 class andiff_lcp
-    : public andiff_base<_type, andiff_lcp<_type, _writer>, _writer> {
-  using base = andiff_base<_type, andiff_lcp<_type, _writer>, _writer>;
+    : public andiff_base<_index, andiff_lcp<_index, _writer>, _writer> {
+  using base = andiff_base<_index, andiff_lcp<_index, _writer>, _writer>;
+  using typename base::_type;
   using base::SA;
   using base::m_source;
-  using base::m_target;
 
  public:
-  andiff_lcp(const std::vector<uint8_t> &source,
-             const std::vector<uint8_t> &target, uint32_t threads_number,
-             _writer &writer)
-      : base(source, target, writer, threads_number) {}
+  andiff_lcp(data_view source, uint32_t threads_number)
+      : base(source, threads_number) {}
+
+  /// Identifies index files built by this class
+  static constexpr uint32_t index_kind = 2;
 
   void prepare_specific() {
-    m_lcp =
-        kasai(m_source.data(), SA.data(), static_cast<_type>(m_source.size()));
-    m_lcp_lr = calculate_lcp_lr(m_lcp);
+    const _type size = static_cast<_type>(m_source.size());
+    std::vector<_index> lcp_lr(m_source.size());
+    calculate_lcp(m_source.data(), SA.data(), size, lcp_lr.data(),
+                  this->m_threads_number);
+    calculate_lcp_lr(lcp_lr.data(), size, this->m_threads_number);
+    m_lcp_lr = index_array<_index>(std::move(lcp_lr));
+    build_tree();
+  }
+
+  void save_index(index_writer &writer) const {
+    writer.add(m_lcp_lr.data(), m_lcp_lr.size());
+  }
+
+  void load_index(const index_reader &reader) {
+    m_lcp_lr = reader.template array<_index>(1);
+    enforce(m_lcp_lr.size() == m_source.size(), "Index has wrong size");
+    build_tree();
   }
 
-  _type search(_type scan, _type &pos) const {
+  _type search(data_view target, _type scan, _type &pos) const {
     return search_lcp(SA.data(), m_source.data(),
-                      static_cast<_type>(m_source.size()), &m_target[scan],
-                      static_cast<_type>(m_target.size()) - scan, &pos,
-                      m_lcp.data(), m_lcp_lr.data());
+                      static_cast<_type>(m_source.size()), &target[scan],
+                      static_cast<_type>(target.size()) - scan, &pos,
+                      m_lcp_lr.data(), m_tree.data(), m_tree.size());
+  }
+
+  ///
+  /// \brief Interleaved search of consecutive positions
+  /// \copydetails andiff_base::search_batch
+  ///
+  void search_batch(data_view target, _type scan, size_t count, _type *len,
+                    _type *pos) const {
+    search_lcp_batch(SA, m_source.data(), static_cast<_type>(m_source.size()),
+                     &target[scan], static_cast<_type>(target.size()) - scan,
+                     count, len, pos, m_lcp_lr.data(), m_tree.data(),
+                     m_tree.size());
   }
 
  private:
-  std::vector<_type> m_lcp;
-  std::vector<_type> m_lcp_lr;
+  /// Tree is small and quick to copy, so it is not kept in index file
+  void build_tree() {
+    m_tree = calculate_lcp_tree(SA.data(), static_cast<_type>(m_source.size()),
+                                m_lcp_lr.data());
+  }
+
+  index_array<_index> m_lcp_lr;
+  std::vector<lcp_node<_type>> m_tree;  ///< Top levels of search
 };
 
-template <template <typename, typename> class diff_class, typename T>
-void andiff_runner(const std::vector<uint8_t> &old,
-                   const std::vector<uint8_t> &target, andiff_writer &stream) {
+///
+/// \brief Search in FM-index of old file instead of suffix array
+/// Longest matches are the same as with andiff_simple, but index takes
+/// about a third of suffix array memory for 64-bit positions.
+///
+template <typename _index, typename _writer>
+class andiff_fm
+    : public andiff_base<_index, andiff_fm<_index, _writer>, _writer> {
+  using base = andiff_base<_index, andiff_fm<_index, _writer>, _writer>;
+  using typename base::_type;
+  using base::m_source;
+
+ public:
+  andiff_fm(data_view source, uint32_t threads_number)
+      : base(source, threads_number) {}
+
+  /// Identifies index files built by this class
+  static constexpr uint32_t index_kind = 3;
+
+  /// Suffix array is sampled inside FM-index
+  static constexpr bool stores_suffix_array = false;
+
+  /// \copydoc andiff_external::set_memory_limit
+  void set_memory_limit(size_t bytes) { m_memory_limit = bytes; }
+
+  /// \copydoc andiff_external::set_temp_dir
+  void set_temp_dir(const std::string &dir) { m_temp_dir = dir; }
+
+  void prepare_specific() {
+    if (m_memory_limit) {
+      m_fm.template build_external<_index>(m_source, m_temp_dir,
+                                           m_memory_limit);
+    } else {
+      m_fm.template build<_index>(m_source, this->m_sa_builder,
+                                  this->m_threads_number);
+    }
+  }
+
+  void save_index(index_writer &writer) const { m_fm.save(writer); }
+
+  void load_index(const index_reader &reader) {
+    m_fm.load(reader, 1, m_source.size());
+  }
+
+  _type search(data_view target, _type scan, _type &pos) const {
+    return m_fm.longest_match(m_source, &target[scan],
+                              static_cast<_type>(target.size()) - scan, &pos);
+  }
+
+ private:
+  size_t m_memory_limit = 0;  ///< Suffix array is built in memory when 0
+  std::string m_temp_dir = default_temp_dir();
+  fm_index<_type> m_fm;
+};
+
+///
+/// \brief Search in hash table of old file blocks instead of suffix array
+/// Table is built in linear time and takes a fraction of suffix array
+/// memory. Matches shorter than a block or not covering a whole block are
+/// missed, so patches are bigger unless old and new files share long
+/// unchanged regions.
+///
+template <typename _index, typename _writer>
+class andiff_hash
+    : public andiff_base<_index, andiff_hash<_index, _writer>, _writer> {
+  using base = andiff_base<_index, andiff_hash<_index, _writer>, _writer>;
+  using typename base::_type;
+  using base::m_source;
+
+ public:
+  andiff_hash(data_view source, uint32_t threads_number)
+      : base(source, threads_number) {}
+
+  /// Identifies index files built by this class
+  static constexpr uint32_t index_kind = 4;
+
+  /// Blocks are found by hash, suffix array is not needed
+  static constexpr bool stores_suffix_array = false;
+
+  void prepare_specific() { m_hash.build(m_source); }
+
+  void save_index(index_writer &writer) const { m_hash.save(writer); }
+
+  void load_index(const index_reader &reader) {
+    m_hash.load(reader, 1, m_source.size());
+  }
+
+  _type search(data_view target, _type scan, _type &pos) const {
+    return m_hash.longest_match(m_source, &target[scan],
+                                static_cast<_type>(target.size()) - scan,
+                                &pos);
+  }
+
+ private:
+  hash_index<_type> m_hash;
+};
+
+///
+/// \brief Suffix array built and searched on disk, for files larger than
+///        memory
+/// Suffix array is built by external_sa_builder into a temporary file and
+/// read through a page cache, so memory of construction and search stays
+/// under the limit. Search is the same as andiff_simple, so are patches.
+/// Old and new files are mapped, kernel pages them in and out.
+///
+template <typename _index, typename _writer>
+class andiff_external
+    : public andiff_base<_index, andiff_external<_index, _writer>, _writer> {
+  using base = andiff_base<_index, andiff_external<_index, _writer>, _writer>;
+  using typename base::_type;
+  using base::m_source;
+
+ public:
+  andiff_external(data_view source, uint32_t threads_number)
+      : base(source, threads_number) {}
+
+  /// Identifies index files built by this class
+  static constexpr uint32_t index_kind = 5;
+
+  /// Suffix array is kept in temporary file
+  static constexpr bool stores_suffix_array = false;
+
+  ///
+  /// \brief Set memory of suffix array construction and search
+  /// \param bytes Limit in bytes
+  ///
+  void set_memory_limit(size_t bytes) { m_memory_limit = bytes; }
+
+  ///
+  /// \brief Set directory of temporary files, it needs space for a few
+  ///        times the suffix array
+  ///
+  void set_temp_dir(const std::string &dir) { m_temp_dir = dir; }
+
+  /// \copydoc andiff_simple::set_prefix_bytes
+  void set_prefix_bytes(uint32_t bytes) {
+    m_prefix_table.set_bytes(bytes);
+    m_prefix_bytes = bytes;
+  }
+
+  void prepare_specific() {
+    const size_t table_memory = prefix_table<_index>::memory(m_prefix_bytes);
+    enforce(m_memory_limit > table_memory,
+            "Memory limit is too small for prefix table");
+    // Two sorters work at the same time, buffers of readers fit in the rest
+    m_sa_file = external_sa_builder<_index>(m_source.data(), m_source.size(),
+                                            m_temp_dir, m_memory_limit / 3)
+                    .build();
+    m_sa.reset(
+        new paged_array<_index>(*m_sa_file, m_memory_limit - table_memory));
+    m_prefix_table.build(*m_sa, m_source);
+  }
+
+  void save_index(index_writer &) const {
+    throw std::runtime_error("Index cannot be used with --memory-limit");
+  }
+
+  void load_index(const index_reader &) {
+    throw std::runtime_error("Index cannot be used with --memory-limit");
+  }
+
+  _type search(data_view target, _type scan, _type &pos) const {
+    return search_bucket(*m_sa, m_prefix_table, m_source, target, scan, &pos);
+  }
+
+  void search_batch(data_view target, _type scan, size_t count, _type *len,
+                    _type *pos) const {
+    search_bucket_batch(*m_sa, m_prefix_table, m_source, target, scan, count,
+                        len, pos);
+  }
+
+ private:
+  size_t m_memory_limit = andiff_default_memory_limit;
+  std::string m_temp_dir = default_temp_dir();
+  uint32_t m_prefix_bytes = andiff_default_prefix_bytes;
+  std::unique_ptr<temp_file> m_sa_file;
+  std::unique_ptr<paged_array<_index>> m_sa;
+  prefix_table<_index> m_prefix_table;
+};
+
+///
+/// \brief Get number of threads used for computations
+/// \return Number of available processors or one if it cannot be detected
+///
+inline uint32_t available_threads() {
   uint32_t thread_number = std::thread::hardware_concurrency();
   if (!thread_number) {
     std::cerr
@@ -593,8 +1116,67 @@ void andiff_runner(const std::vector<uint8_t> &old,
         << std::endl;
     thread_number = 1;
   }
+  return thread_number;
+}
+
+///
+/// \brief Options of comparison
+///
+struct diff_options {
+  uint32_t threads_number = available_threads();
+  size_t queue_memory = andiff_default_queue_memory;
+  std::string index_path;  ///< Index file, empty when not used
+  sa_builder_id sa_builder = sa_builder_id::divsufsort;
+  uint32_t prefix_bytes = andiff_default_prefix_bytes;  ///< --prefix-bytes
+  size_t memory_limit = 0;  ///< --memory-limit, 0 keeps index in memory
+  std::string temp_dir = default_temp_dir();  ///< --temp-dir
+};
+
+///
+/// \brief Apply options of one search method, others have none
+///
+template <typename diff_type>
+void configure_search(diff_type &, const diff_options &) {}
+
+template <typename _index, typename _writer>
+void configure_search(andiff_simple<_index, _writer> &data_compare,
+                      const diff_options &options) {
+  data_compare.set_prefix_bytes(options.prefix_bytes);
+}
+
+template <typename _index, typename _writer>
+void configure_search(andiff_external<_index, _writer> &data_compare,
+                      const diff_options &options) {
+  data_compare.set_prefix_bytes(options.prefix_bytes);
+  data_compare.set_memory_limit(options.memory_limit);
+  data_compare.set_temp_dir(options.temp_dir);
+}
+
+template <typename _index, typename _writer>
+void configure_search(andiff_fm<_index, _writer> &data_compare,
+                      const diff_options &options) {
+  data_compare.set_memory_limit(options.memory_limit);
+  data_compare.set_temp_dir(options.temp_dir);
+}
+
+///
+/// \brief New file and writer of its patch
+///
+using diff_target = std::pair<data_view, andiff_writer *>;
 
-  diff_class<T, andiff_writer> data_compare(old, target, thread_number, stream);
+template <template <typename, typename> class diff_class, typename T>
+void andiff_runner(data_view old, const std::vector<diff_target> &targets,
+                   const diff_options &options) {
+  diff_class<T, andiff_writer> data_compare(old, options.threads_number);
+  for (const auto &target : targets) {
+    data_compare.add_target(target.first, *target.second);
+  }
+  data_compare.set_queue_memory(options.queue_memory);
+  configure_search(data_compare, options);
+  data_compare.set_sa_builder(options.sa_builder);
+  if (!options.index_path.empty()) {
+    data_compare.set_index_file(options.index_path);
+  }
   data_compare.run();
 }
 
@@ -27,8 +27,97 @@
 #ifndef ANDIFF_PRIVATE_HPP
 #define ANDIFF_PRIVATE_HPP
 
-static constexpr char andiff_magic[17] = "ANDIFF090";
+#include <cstddef>
+#include <cstdint>
+
+/// Patch with whole payload in one bzip2 stream
+static constexpr char andiff_magic_bz2_stream[17] = "ANDIFF090";
+
+/// Patch with separate sections, codecs in header and index at the end
+static constexpr char andiff_magic[17] = "ANDIFF091";
 
 static_assert(sizeof(andiff_magic) == 17, "Different size of Magic Sequence");
+static_assert(sizeof(andiff_magic_bz2_stream) == sizeof(andiff_magic),
+              "Different size of Magic Sequence");
+
+/// Sections of patch, in the order they are stored in andiff_magic format
+enum patch_section { section_control = 0, section_diff = 1, section_extra = 2 };
+
+/// Size of uncompressed payload in one chunk
+static constexpr int64_t andiff_chunk_size = 1024 * 1024;
+
+/// Codec field in header: codec_id of every section, rest is reserved
+static constexpr size_t andiff_codecs_size = 8;
+
+/// Chunk header: uncompressed size and compressed size
+static constexpr size_t andiff_chunk_header_size = 2 * 8;
+
+/// Minimal distance in new file between seek points of patch index
+static constexpr int64_t andiff_seek_interval = 1024 * 1024;
+
+/// Default memory limit of diff records waiting for save thread
+static constexpr size_t andiff_default_queue_memory = 64 * 1024 * 1024;
+
+/// Default number of bytes of suffix prefix table, 64K buckets
+static constexpr uint32_t andiff_default_prefix_bytes = 2;
+
+/// Maximum number of bytes of suffix prefix table, 16M buckets
+static constexpr uint32_t andiff_max_prefix_bytes = 3;
+
+/// Default memory of suffix array construction and search on disk
+static constexpr size_t andiff_default_memory_limit = 1024 * 1024 * 1024;
+
+/// Maximum number of positions of new file searched together
+static constexpr size_t andiff_search_batch = 8;
+
+///
+/// \brief Convert int64_t to array of uint8_t
+/// \param x Value to convert
+/// \param buf Output buffer
+///
+static inline void offtout(int64_t x, uint8_t *buf) {
+  int64_t y;
+
+  if (x < 0)
+    y = -x;
+  else
+    y = x;
+
+  for (int i = 0; i < 8; ++i) {
+    buf[i] = static_cast<uint8_t>(y & 0xFF);
+    y >>= 8;
+  }
+
+  if (x < 0) buf[7] |= 0x80;
+}
+
+///
+/// \brief Convert array of uint8_t to int64_t
+/// \param buf Input buffer
+/// \return Decoded value
+///
+static inline int64_t offtin(const uint8_t *buf) {
+  int64_t y;
+
+  y = buf[7] & 0x7F;
+  y <<= 8;
+  y += buf[6];
+  y <<= 8;
+  y += buf[5];
+  y <<= 8;
+  y += buf[4];
+  y <<= 8;
+  y += buf[3];
+  y <<= 8;
+  y += buf[2];
+  y <<= 8;
+  y += buf[1];
+  y <<= 8;
+  y += buf[0];
+
+  if (buf[7] & 0x80) y = -y;
+
+  return y;
+}
 
 #endif  // ANDIFF_PRIVATE_HPP
@@ -29,22 +29,96 @@
 #include "anpatch.hpp"
 
 #include <iostream>
+#include <string>
+
+#include <getopt.h>
+#include <sys/stat.h>
+
+static void usage(const char* name) {
+  std::cerr << "Usage: " << name << " [options] oldfile newfile patchfile\n"
+            << "Options:\n"
+            << "  --range=BEGIN:END  Rebuild only bytes BEGIN to END of new "
+               "file\n"
+            << "  --threads=N        Number of threads applying patch\n"
+            << std::endl;
+}
+
+///
+/// \brief Parse value of --range option
+/// \param arg   Two positions separated by colon
+/// \param begin Output first byte
+/// \param end   Output byte after the last one
+///
+static void parse_range(const std::string& arg, int64_t& begin, int64_t& end) {
+  size_t colon = arg.find(':');
+  if (colon == std::string::npos) {
+    throw std::invalid_argument("--range expects BEGIN:END");
+  }
+  begin = std::stoll(arg.substr(0, colon));
+  end = std::stoll(arg.substr(colon + 1));
+  enforce(begin >= 0 && begin <= end, "--range expects BEGIN <= END");
+}
+
+///
+/// \brief Check if output can be written at any position
+/// \param file_path Path to output, it may not exist yet
+/// \return false for pipes and devices
+///
+static bool is_seekable_output(const std::string& file_path) {
+  struct stat st;
+  return ::stat(file_path.c_str(), &st) != 0 || S_ISREG(st.st_mode);
+}
 
 int main(int argc, char* argv[]) {
   try {
-    /// @todo Add more intelligent algorithm for parsing cmd arguments
-    if (argc != 4) {
-      std::cerr << "Usage: " << argv[0] << " oldfile newfile patchfile"
-                << std::endl;
+    bool is_range = false;
+    int64_t range_begin = 0;
+    int64_t range_end = 0;
+    uint32_t threads_number = std::max(1u, std::thread::hardware_concurrency());
+
+    static const option long_options[] = {
+        {"range", required_argument, nullptr, 'r'},
+        {"threads", required_argument, nullptr, 't'},
+        {nullptr, 0, nullptr, 0}};
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+      switch (opt) {
+        case 'r':
+          is_range = true;
+          parse_range(optarg, range_begin, range_end);
+          break;
+        case 't':
+          threads_number = static_cast<uint32_t>(std::stoul(optarg));
+          enforce(threads_number > 0, "--threads expects positive number");
+          break;
+        default:
+          usage(argv[0]);
+          exit(1);
+      }
+    }
+
+    if (argc - optind != 3) {
+      usage(argv[0]);
       exit(1);
     }
 
-    file_array old_file(argv[1]);
-    anpatch_reader patch_file(argv[3], andiff_magic);
-    std::string new_file = argv[2];
+    thread_pool decompress_pool(threads_number);
+    anpatch_reader patch_file(argv[optind + 2], decompress_pool);
+    std::string new_file = argv[optind + 1];
+
+    // Patch with index can be applied in independent parts
+    if (!is_range && threads_number > 1 && patch_file.has_index() &&
+        is_seekable_output(new_file)) {
+      parallel_patcher patcher(argv[optind], std::move(patch_file), new_file,
+                               threads_number, 1024 * 1024);
+      patcher.run();
+      return 0;
+    }
 
+    old_file_array old_file(argv[optind]);
     anpatcher<uint8_t> patcher(std::move(old_file), std::move(patch_file),
-                               new_file, 5 * 1024);
+                               new_file, 1024 * 1024);
+    if (is_range) patcher.set_range(range_begin, range_end);
     patcher.run();
   } catch (std::exception& e) {
     std::cerr << "Something went wrong: " << e.what() << std::endl;
@@ -32,100 +32,397 @@
 #include "andiff_private.hpp"
 #include "file_maped_array.hpp"
 #include "readers.hpp"
+#include "simd.hpp"
+#include "synchronized_queue.hpp"
 #include "writers.hpp"
 
-static int64_t offtin(uint8_t* buf) {
-  int64_t y;
-
-  y = buf[7] & 0x7F;
-  y <<= 8;
-  y += buf[6];
-  y <<= 8;
-  y += buf[5];
-  y <<= 8;
-  y += buf[4];
-  y <<= 8;
-  y += buf[3];
-  y <<= 8;
-  y += buf[2];
-  y <<= 8;
-  y += buf[1];
-  y <<= 8;
-  y += buf[0];
-
-  if (buf[7] & 0x80) y = -y;
-
-  return y;
-}
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
+///
+/// \brief Applies patch to old file
+///
+/// Work is split into three stages running on separate threads: reading of
+/// decompressed patch data, adding old file bytes to diff data and writing
+/// of new file. Stages pass blocks through queues. The number of blocks is
+/// fixed, so a fast stage waits for the slow one instead of using memory.
+///
 template <typename block_type>
 class anpatcher {
  public:
-  anpatcher(file_array&& old_file, anpatch_reader&& patch_file,
+  anpatcher(old_file_array&& old_file, anpatch_reader&& patch_file,
             std::string& output_file, ssize_t block_size)
-      : m_data(new block_type[block_size]),
+      : m_blocks(pipeline_blocks),
         m_block_size(block_size),
         m_old_pos(0),
+        m_new_pos(0),
+        m_pending_ctrl(false),
         m_old_file(std::move(old_file)),
         m_patch_file(std::move(patch_file)) {
+    for (auto& block : m_blocks) {
+      block.data.reset(new block_type[block_size]);
+    }
+    m_end = m_patch_file.new_size();
     m_new_file.open(output_file);
   }
 
-  void run() {
+  ///
+  /// \brief Rebuild only part of new file, requires patch with index
+  /// Reading starts at seek point before begin, control records up to begin
+  /// are only read, sections of data are moved directly to begin.
+  /// \param begin First byte of new file
+  /// \param end   Byte after the last one, clamped to new file size
+  ///
+  void set_range(int64_t begin, int64_t end) {
+    enforce_throw(m_patch_file.has_index(), "Patch has no index");
+    m_end = std::min(end, m_patch_file.new_size());
+    enforce_throw(begin >= 0 && begin <= m_end, "Wrong range");
+
+    const seek_point& point = m_patch_file.index().find(begin);
+    m_new_pos = point.new_pos;
+    m_old_pos = point.old_pos;
+    std::array<int64_t, 3> section_pos = point.section_pos;
+    m_patch_file.seek(section_control, section_pos[section_control]);
+
+    // Find record which contains begin
     while (!m_patch_file.eof()) {
-      read_control_data();
-      apply_diff();
-      apply_data();
+      m_patch_file.read_control(m_ctrl);
+      check_control();
+      if (m_new_pos + m_ctrl[0] + m_ctrl[1] > begin) {
+        m_pending_ctrl = true;
+        break;
+      }
+      m_new_pos += m_ctrl[0] + m_ctrl[1];
+      m_old_pos += m_ctrl[0] + m_ctrl[2];
+      section_pos[section_diff] += m_ctrl[0];
+      section_pos[section_extra] += m_ctrl[1];
+    }
+
+    // Leave only the part of record from begin
+    int64_t skip = begin - m_new_pos;
+    if (m_pending_ctrl) {
+      int64_t diff_skip = std::min(skip, m_ctrl[0]);
+      int64_t extra_skip = skip - diff_skip;
+      m_ctrl[0] -= diff_skip;
+      m_ctrl[1] -= extra_skip;
+      m_old_pos += diff_skip;
+      section_pos[section_diff] += diff_skip;
+      section_pos[section_extra] += extra_skip;
+    }
+    m_new_pos = begin;
+    m_patch_file.seek(section_diff, section_pos[section_diff]);
+    m_patch_file.seek(section_extra, section_pos[section_extra]);
+  }
+
+  void run() {
+    for (auto& block : m_blocks) {
+      patch_block* free_block = &block;
+      m_free.push(free_block);
+    }
+
+    std::thread reader(&anpatcher::read_stage, this);
+    std::thread writer(&anpatcher::write_stage, this);
+    apply_stage();
+    reader.join();
+    writer.join();
+
+    // Queues have to be empty when destroyed
+    for (auto* queue : {&m_free, &m_to_apply, &m_to_write}) {
+      queue->close();
+      patch_block* block;
+      while (queue->wait_and_pop(block)) {
+      }
     }
+    if (m_error) std::rethrow_exception(m_error);
   }
 
  private:
-  void read_control_data() {
-    uint8_t buf[8];
-    for (int i = 0; i <= 2; i++) {
-      m_patch_file.read(buf, sizeof(buf));
-      m_ctrl[i] = offtin(buf);
+  /// Number of blocks passed between stages
+  static const size_t pipeline_blocks = 8;
+
+  struct patch_block {
+    std::unique_ptr<block_type[]> data;
+    ssize_t size;
+    int64_t old_pos;  ///< Old file position of diff data, -1 for extra data
+  };
+
+  ///
+  /// \brief First stage, reads control records and data they describe
+  ///
+  void read_stage() {
+    try {
+      while (m_new_pos < m_end) {
+        if (!m_pending_ctrl) {
+          enforce_throw(!m_patch_file.eof(), "Corrupt patch");
+          m_patch_file.read_control(m_ctrl);
+          check_control();
+        }
+        m_pending_ctrl = false;
+
+        int64_t diff_size = std::min(m_ctrl[0], m_end - m_new_pos);
+        if (!read_data(diff_size, m_old_pos)) break;
+        m_new_pos += diff_size;
+        m_old_pos += m_ctrl[0];
+        int64_t extra_size = std::min(m_ctrl[1], m_end - m_new_pos);
+        if (!read_data(extra_size, -1)) break;
+        m_new_pos += extra_size;
+        m_old_pos += m_ctrl[2];
+      }
+    } catch (...) {
+      fail();
+    }
+    m_to_apply.close();
+  }
+
+  ///
+  /// \brief Reject control record which does not fit into new file
+  ///
+  void check_control() const {
+    const int64_t left = m_patch_file.new_size() - m_new_pos;
+    enforce_throw(m_ctrl[0] >= 0 && m_ctrl[1] >= 0 && m_ctrl[0] <= left &&
+                      m_ctrl[1] <= left - m_ctrl[0],
+                  "Corrupt patch");
+  }
+
+  ///
+  /// \brief Read diff or extra data into blocks
+  /// \param size    Number of bytes to read
+  /// \param old_pos Old file position of diff data, -1 for extra data
+  /// \return false if other stage has failed
+  ///
+  bool read_data(int64_t size, int64_t old_pos) {
+    int64_t processed = 0;
+    while (processed < size) {
+      patch_block* block;
+      if (!m_free.wait_and_pop(block)) return false;
+      int64_t to_read = std::min(size - processed, m_block_size);
+      block->size = old_pos < 0
+                        ? m_patch_file.read_extra(block->data.get(), to_read)
+                        : m_patch_file.read_diff(block->data.get(), to_read);
+      block->old_pos = old_pos < 0 ? -1 : old_pos + processed;
+      processed += block->size;
+      m_to_apply.push(block);
     }
+    return true;
   }
 
-  void apply_diff() {
-    int64_t read_size = 0;
-    while (read_size < m_ctrl[0]) {
-      int64_t to_read = read_size + m_block_size > m_ctrl[0]
-                            ? m_ctrl[0] - read_size
-                            : m_block_size;
-      ssize_t cur_read_size = m_patch_file.read(m_data.get(), to_read);
-      for (ssize_t i = 0; i < cur_read_size; ++i) {
-        m_data[i] += m_old_file[m_old_pos + read_size + i];
+  ///
+  /// \brief Second stage, adds old file bytes to diff data
+  ///
+  void apply_stage() {
+    try {
+      patch_block* block;
+      while (m_to_apply.wait_and_pop(block)) {
+        if (block->old_pos >= 0) {
+          const uint8_t* old_data =
+              m_old_file.span(block->old_pos, block->size);
+          add_bytes(block->data.get(), old_data,
+                    static_cast<size_t>(block->size));
+        }
+        m_to_write.push(block);
       }
-      m_new_file.write(m_data.get(), cur_read_size);
-      read_size += cur_read_size;
+    } catch (...) {
+      fail();
     }
-    m_old_pos += m_ctrl[0];
+    m_to_write.close();
   }
 
-  void apply_data() {
-    ssize_t processed = 0;
-    while (processed < m_ctrl[1]) {
-      ssize_t to_read = processed + m_block_size > m_ctrl[1]
-                            ? m_ctrl[1] - processed
-                            : m_block_size;
-      ssize_t cur_read_size = m_patch_file.read(m_data.get(), to_read);
-      m_new_file.write(m_data.get(), cur_read_size);
-      processed += cur_read_size;
+  ///
+  /// \brief Last stage, writes new file and returns blocks to first stage
+  ///
+  void write_stage() {
+    try {
+      patch_block* block;
+      while (m_to_write.wait_and_pop(block)) {
+        ssize_t written = 0;
+        while (written < block->size) {
+          written += m_new_file.write(block->data.get() + written,
+                                      block->size - written);
+        }
+        m_free.push(block);
+      }
+    } catch (...) {
+      fail();
     }
+  }
 
-    m_old_pos += m_ctrl[2];
+  ///
+  /// \brief Keep current exception and stop all stages
+  ///
+  void fail() {
+    {
+      std::lock_guard<std::mutex> lock(m_error_mutex);
+      if (!m_error) m_error = std::current_exception();
+    }
+    m_free.close();
+    m_to_apply.close();
+    m_to_write.close();
   }
 
  private:
   int64_t m_ctrl[3];
-  std::unique_ptr<block_type[]> m_data;
+  std::vector<patch_block> m_blocks;  ///< Storage of all blocks
   int64_t m_block_size;
   int64_t m_old_pos;
-  file_array m_old_file;
+  int64_t m_new_pos;
+  int64_t m_end;        ///< Stop at this position of new file
+  bool m_pending_ctrl;  ///< m_ctrl is read but not applied yet
+  old_file_array m_old_file;
   anpatch_reader m_patch_file;
   file_writer m_new_file;
+  synchronized_queue<patch_block*> m_free;      ///< Blocks ready to read
+  synchronized_queue<patch_block*> m_to_apply;  ///< Blocks with patch data
+  synchronized_queue<patch_block*> m_to_write;  ///< Blocks with new data
+  std::mutex m_error_mutex;
+  std::exception_ptr m_error;  ///< First error of any stage
+};
+
+template <typename block_type>
+const size_t anpatcher<block_type>::pipeline_blocks;
+
+///
+/// \brief Applies patch with index on many threads
+///
+/// New file is split at seek points of patch_index into tasks. Seek point
+/// keeps positions in old file and in every section, so a task depends only
+/// on old file and its own part of the patch. Every worker reads its tasks
+/// with own patch reader and writes them at their positions in new file.
+///
+class parallel_patcher {
+ public:
+  ///
+  /// \brief Constructor
+  /// \param old_path       Path to old file, every worker maps it
+  /// \param patch_file     Reader of patch with index
+  /// \param output_file    Path to new file
+  /// \param threads_number Number of worker threads
+  /// \param block_size     Size of buffer of every worker
+  ///
+  parallel_patcher(const std::string& old_path, anpatch_reader&& patch_file,
+                   const std::string& output_file, uint32_t threads_number,
+                   int64_t block_size)
+      : m_old_path(old_path),
+        m_patch_file(std::move(patch_file)),
+        m_threads_number(std::max<uint32_t>(threads_number, 1)),
+        m_block_size(block_size),
+        m_next_task(0) {
+    enforce_throw(m_patch_file.has_index(), "Patch has no index");
+    m_new_file.open(output_file);
+
+    // Neighbouring seek points are joined, so every task is big enough to
+    // hide the cost of opening sections
+    const auto& points = m_patch_file.index().points();
+    for (size_t i = 0; i < points.size(); ++i) {
+      if (m_tasks.empty() ||
+          points[i].new_pos - points[m_tasks.back()].new_pos >= task_size) {
+        m_tasks.push_back(i);
+      }
+    }
+  }
+
+  void run() {
+    m_new_file.resize(m_patch_file.new_size());
+
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < m_threads_number; ++i) {
+      threads.emplace_back(&parallel_patcher::worker, this);
+    }
+    for (auto& thread : threads) thread.join();
+
+    m_new_file.close();
+    if (m_error) std::rethrow_exception(m_error);
+  }
+
+ private:
+  /// Minimal size of new file processed by one task
+  static const int64_t task_size = 4 * andiff_seek_interval;
+
+  void worker() {
+    try {
+      anpatch_reader patch_file = m_patch_file.detached();
+      old_file_array old_file(m_old_path);
+      std::unique_ptr<uint8_t[]> data(new uint8_t[m_block_size]);
+      size_t task;
+      while ((task = m_next_task++) < m_tasks.size()) {
+        apply_task(task, patch_file, old_file, data.get());
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(m_error_mutex);
+      if (!m_error) m_error = std::current_exception();
+      m_next_task = m_tasks.size();  // Stop other workers
+    }
+  }
+
+  ///
+  /// \brief Rebuild part of new file between seek points
+  /// \param task       Index of task
+  /// \param patch_file Patch reader of worker
+  /// \param old_file   Old file of worker
+  /// \param data       Buffer of worker
+  ///
+  void apply_task(size_t task, anpatch_reader& patch_file,
+                  old_file_array& old_file, uint8_t* data) {
+    const auto& points = m_patch_file.index().points();
+    const seek_point& begin = points[m_tasks[task]];
+    const bool last = task + 1 == m_tasks.size();
+    const int64_t end = last ? m_patch_file.new_size()
+                             : points[m_tasks[task + 1]].new_pos;
+
+    // Only data of this task is decompressed
+    for (size_t i = 0; i < begin.section_pos.size(); ++i) {
+      int64_t limit = last ? -1 : points[m_tasks[task + 1]].section_pos[i] -
+                                      begin.section_pos[i];
+      patch_file.seek(static_cast<patch_section>(i), begin.section_pos[i],
+                      limit);
+    }
+
+    int64_t new_pos = begin.new_pos;
+    int64_t old_pos = begin.old_pos;
+    int64_t ctrl[3];
+    while (new_pos < end) {
+      patch_file.read_control(ctrl);
+      enforce_throw(ctrl[0] >= 0 && ctrl[1] >= 0 &&
+                        new_pos + ctrl[0] + ctrl[1] <= end,
+                    "Corrupt patch");
+
+      int64_t done = 0;
+      while (done < ctrl[0]) {
+        ssize_t size = patch_file.read_diff(
+            data, std::min(ctrl[0] - done, m_block_size));
+        add_bytes(data, old_file.span(old_pos + done, size),
+                  static_cast<size_t>(size));
+        m_new_file.write_at(data, size, new_pos + done);
+        done += size;
+      }
+      new_pos += ctrl[0];
+
+      done = 0;
+      while (done < ctrl[1]) {
+        ssize_t size = patch_file.read_extra(
+            data, std::min(ctrl[1] - done, m_block_size));
+        m_new_file.write_at(data, size, new_pos + done);
+        done += size;
+      }
+      new_pos += ctrl[1];
+      old_pos += ctrl[0] + ctrl[2];
+    }
+  }
+
+  const std::string m_old_path;
+  anpatch_reader m_patch_file;  ///< Header and index shared by workers
+  file_writer m_new_file;
+  const uint32_t m_threads_number;
+  const int64_t m_block_size;
+  std::vector<size_t> m_tasks;  ///< First seek point of every task
+  std::atomic<size_t> m_next_task;
+  std::mutex m_error_mutex;
+  std::exception_ptr m_error;  ///< First error of any worker
 };
 
 #endif  // ANPATCH_HPP
@@ -0,0 +1,133 @@
+/*-
+ * Copyright 2016 Jakub Nyckowski
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CHECKSUM_HPP
+#define CHECKSUM_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace checksum_detail {
+
+static constexpr uint64_t prime1 = 11400714785074694791ULL;
+static constexpr uint64_t prime2 = 14029467366897019727ULL;
+static constexpr uint64_t prime3 = 1609587929392839161ULL;
+static constexpr uint64_t prime4 = 9650029242287828579ULL;
+static constexpr uint64_t prime5 = 2870177450012600261ULL;
+
+inline uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+inline uint64_t read64(const uint8_t *p) {
+  uint64_t v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint32_t read32(const uint8_t *p) {
+  uint32_t v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint64_t round(uint64_t acc, uint64_t input) {
+  acc += input * prime2;
+  return rotl(acc, 31) * prime1;
+}
+
+inline uint64_t merge_round(uint64_t acc, uint64_t val) {
+  acc ^= round(0, val);
+  return acc * prime1 + prime4;
+}
+
+}  // namespace checksum_detail
+
+///
+/// \brief 64 bit XXH64 hash of buffer
+///
+/// Values are read in native byte order, so checksums are comparable only
+/// between machines of the same endianness.
+///
+/// \param data Input data
+/// \param size Size of input data
+/// \param seed Initial value
+/// \return Hash
+///
+inline uint64_t checksum64(const void *data, size_t size, uint64_t seed = 0) {
+  using namespace checksum_detail;
+  const uint8_t *p = static_cast<const uint8_t *>(data);
+  const uint8_t *const end = p + size;
+  uint64_t h;
+
+  if (size >= 32) {
+    // Four independent lanes keep the multiplier busy
+    uint64_t v1 = seed + prime1 + prime2;
+    uint64_t v2 = seed + prime2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - prime1;
+    const uint8_t *const limit = end - 32;
+    do {
+      v1 = round(v1, read64(p));
+      v2 = round(v2, read64(p + 8));
+      v3 = round(v3, read64(p + 16));
+      v4 = round(v4, read64(p + 24));
+      p += 32;
+    } while (p <= limit);
+
+    h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+    h = merge_round(h, v1);
+    h = merge_round(h, v2);
+    h = merge_round(h, v3);
+    h = merge_round(h, v4);
+  } else {
+    h = seed + prime5;
+  }
+
+  h += static_cast<uint64_t>(size);
+
+  for (; p + 8 <= end; p += 8) {
+    h ^= round(0, read64(p));
+    h = rotl(h, 27) * prime1 + prime4;
+  }
+  if (p + 4 <= end) {
+    h ^= static_cast<uint64_t>(read32(p)) * prime1;
+    h = rotl(h, 23) * prime2 + prime3;
+    p += 4;
+  }
+  for (; p < end; ++p) {
+    h ^= (*p) * prime5;
+    h = rotl(h, 11) * prime1;
+  }
+
+  h ^= h >> 33;
+  h *= prime2;
+  h ^= h >> 29;
+  h *= prime3;
+  h ^= h >> 32;
+  return h;
+}
+
+#endif  // CHECKSUM_HPP
@@ -0,0 +1,227 @@
+/*-
+ * Copyright 2016 Jakub Nyckowski
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CODECS_HPP
+#define CODECS_HPP
+
+#include "enforce.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <bzlib.h>
+
+#if defined(ANDIFF_HAVE_ZLIB)
+#include <zlib.h>
+#endif
+
+#if defined(ANDIFF_HAVE_LZMA)
+#include <lzma.h>
+#endif
+
+///
+/// \brief Identifiers of codecs, stored in patch header
+///
+enum class codec_id : uint8_t { none = 0, bzip2 = 1, zlib = 2, xz = 3 };
+
+///
+/// \brief Block compression interface
+///
+/// Every chunk of a patch section is compressed separately, so codecs work
+/// on whole buffers and keep no state between calls. Methods can be called
+/// from many threads at once.
+///
+class base_codec {
+ public:
+  virtual ~base_codec() = default;
+
+  ///
+  /// \brief Compress buffer
+  /// \param data Input data
+  /// \param size Size of input data
+  /// \return Compressed data
+  ///
+  virtual std::vector<uint8_t> compress(const uint8_t* data,
+                                        size_t size) const = 0;
+
+  ///
+  /// \brief Decompress buffer
+  /// \param data     Compressed data
+  /// \param size     Size of compressed data
+  /// \param out      Output buffer
+  /// \param raw_size Size of data after decompression
+  ///
+  virtual void decompress(const uint8_t* data, size_t size, uint8_t* out,
+                          size_t raw_size) const = 0;
+};
+
+///
+/// \brief Stores data without compression
+///
+class none_codec : public base_codec {
+ public:
+  std::vector<uint8_t> compress(const uint8_t* data,
+                                size_t size) const override {
+    return std::vector<uint8_t>(data, data + size);
+  }
+
+  void decompress(const uint8_t* data, size_t size, uint8_t* out,
+                  size_t raw_size) const override {
+    enforce_throw(size == raw_size, "Corrupt patch chunk");
+    std::memcpy(out, data, size);
+  }
+};
+
+///
+/// \brief bzip2 with 900k blocks, best ratio of always available codecs
+///
+class bzip2_codec : public base_codec {
+ public:
+  std::vector<uint8_t> compress(const uint8_t* data,
+                                size_t size) const override {
+    // bzip2 documentation: output buffer should be 1% larger + 600 bytes
+    unsigned int compressed_size =
+        static_cast<unsigned int>(size + size / 100 + 600);
+    std::vector<uint8_t> compressed(compressed_size);
+    int bz2err = BZ2_bzBuffToBuffCompress(
+        reinterpret_cast<char*>(compressed.data()), &compressed_size,
+        const_cast<char*>(reinterpret_cast<const char*>(data)),
+        static_cast<unsigned int>(size), 9, 0, 0);
+    enforce(bz2err == BZ_OK, "Error while compressing bz2 chunk");
+    compressed.resize(compressed_size);
+    return compressed;
+  }
+
+  void decompress(const uint8_t* data, size_t size, uint8_t* out,
+                  size_t raw_size) const override {
+    unsigned int dest_size = static_cast<unsigned int>(raw_size);
+    int bz2err = BZ2_bzBuffToBuffDecompress(
+        reinterpret_cast<char*>(out), &dest_size,
+        const_cast<char*>(reinterpret_cast<const char*>(data)),
+        static_cast<unsigned int>(size), 0, 0);
+    enforce_throw(bz2err == BZ_OK && dest_size == raw_size, "bz2 read error");
+  }
+};
+
+#if defined(ANDIFF_HAVE_ZLIB)
+///
+/// \brief zlib at fastest level, cheap to compress and to apply
+///
+class zlib_codec : public base_codec {
+ public:
+  std::vector<uint8_t> compress(const uint8_t* data,
+                                size_t size) const override {
+    uLongf compressed_size = compressBound(static_cast<uLong>(size));
+    std::vector<uint8_t> compressed(compressed_size);
+    int ret = compress2(compressed.data(), &compressed_size, data,
+                        static_cast<uLong>(size), Z_BEST_SPEED);
+    enforce(ret == Z_OK, "Error while compressing zlib chunk");
+    compressed.resize(compressed_size);
+    return compressed;
+  }
+
+  void decompress(const uint8_t* data, size_t size, uint8_t* out,
+                  size_t raw_size) const override {
+    uLongf dest_size = static_cast<uLongf>(raw_size);
+    int ret = uncompress(out, &dest_size, data, static_cast<uLong>(size));
+    enforce_throw(ret == Z_OK && dest_size == raw_size, "zlib read error");
+  }
+};
+#endif
+
+#if defined(ANDIFF_HAVE_LZMA)
+///
+/// \brief xz (LZMA2) at default preset, smallest patches
+///
+class xz_codec : public base_codec {
+ public:
+  std::vector<uint8_t> compress(const uint8_t* data,
+                                size_t size) const override {
+    std::vector<uint8_t> compressed(lzma_stream_buffer_bound(size));
+    size_t compressed_size = 0;
+    lzma_ret ret = lzma_easy_buffer_encode(
+        LZMA_PRESET_DEFAULT, LZMA_CHECK_NONE, nullptr, data, size,
+        compressed.data(), &compressed_size, compressed.size());
+    enforce(ret == LZMA_OK, "Error while compressing xz chunk");
+    compressed.resize(compressed_size);
+    return compressed;
+  }
+
+  void decompress(const uint8_t* data, size_t size, uint8_t* out,
+                  size_t raw_size) const override {
+    uint64_t memlimit = UINT64_MAX;
+    size_t in_pos = 0;
+    size_t out_pos = 0;
+    lzma_ret ret = lzma_stream_buffer_decode(&memlimit, 0, nullptr, data,
+                                             &in_pos, size, out, &out_pos,
+                                             raw_size);
+    enforce_throw(ret == LZMA_OK && out_pos == raw_size, "xz read error");
+  }
+};
+#endif
+
+///
+/// \brief Create codec
+/// \param id Codec identifier
+/// \return Codec, exception is thrown when codec is not compiled in
+///
+inline std::shared_ptr<const base_codec> make_codec(codec_id id) {
+  switch (id) {
+    case codec_id::none:
+      return std::make_shared<none_codec>();
+    case codec_id::bzip2:
+      return std::make_shared<bzip2_codec>();
+#if defined(ANDIFF_HAVE_ZLIB)
+    case codec_id::zlib:
+      return std::make_shared<zlib_codec>();
+#endif
+#if defined(ANDIFF_HAVE_LZMA)
+    case codec_id::xz:
+      return std::make_shared<xz_codec>();
+#endif
+    default:
+      throw std::runtime_error("Codec is not supported by this build");
+  }
+}
+
+///
+/// \brief Find codec by name
+/// \param name One of: none, bzip2, zlib, xz
+/// \return Codec identifier, exception is thrown for unknown name
+///
+inline codec_id codec_from_name(const std::string& name) {
+  if (name == "none") return codec_id::none;
+  if (name == "bzip2") return codec_id::bzip2;
+  if (name == "zlib") return codec_id::zlib;
+  if (name == "xz") return codec_id::xz;
+  throw std::invalid_argument("Unknown codec: " + name);
+}
+
+#endif  // CODECS_HPP
@@ -30,6 +30,9 @@
 #include <assert.h>
 #include <stdlib.h>
 
+#include <stdexcept>
+#include <string>
+
 #define STR(x) #x
 
 #if !defined(NDEBUG)
@@ -48,4 +51,18 @@
   } while (0)
 #endif
 
+///
+/// \brief Throw std::runtime_error when condition is not met, in any build
+/// For corrupt input and failed I/O. Threads catch it and stop the others,
+/// enforce would end the whole process from the thread which failed.
+///
+#define enforce_throw(cond, msg)                                       \
+  do {                                                                 \
+    if (!(cond)) {                                                     \
+      throw std::runtime_error(std::string(msg) + "\n" STR(cond) " at " \
+                               __FILE__ ":" +                          \
+                               std::to_string(__LINE__));              \
+    }                                                                  \
+  } while (0)
+
 #endif  // ENFORCE_HPP
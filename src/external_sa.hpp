@@ -0,0 +1,297 @@
+/*-
+ * Copyright 2016 Jakub Nyckowski
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef EXTERNAL_SA_HPP
+#define EXTERNAL_SA_HPP
+
+#include "external_sort.hpp"
+#include "int40.hpp"
+
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <string>
+
+///
+/// \brief Largest value of index type
+///
+template <typename I>
+inline int64_t index_max() {
+  return std::numeric_limits<I>::max();
+}
+
+template <>
+inline int64_t index_max<int40_t>() {
+  return int40_max;
+}
+
+///
+/// \brief Suffix array construction on disk by prefix doubling
+///
+/// Suffixes are first sorted by their first bytes, then every round sorts
+/// suffixes of unfinished groups by rank of group h bytes further, which
+/// doubles sorted prefix. Rank of every suffix is kept in a file in text
+/// order and read sequentially; sorting is done by external_sorter, so
+/// memory does not depend on size of text. Suffixes which have their own
+/// group are finished and take no part in later rounds. Rounds are
+/// logarithmic in the longest repeat.
+///
+/// Rank file holds row of the first suffix of its group, bitwise negated
+/// when the group has more than one suffix.
+///
+template <typename I>
+class external_sa_builder {
+ public:
+  using value_type = index_value_t<I>;
+
+  ///
+  /// \param str    Text
+  /// \param size   Size of text
+  /// \param dir    Directory of temporary files
+  /// \param memory Memory used by sorting
+  ///
+  external_sa_builder(const uint8_t *str, size_t size, const std::string &dir,
+                      size_t memory)
+      : m_str(str),
+        m_size(static_cast<value_type>(size)),
+        m_dir(dir),
+        m_memory(memory),
+        m_buffer_memory(std::max<size_t>(std::min<size_t>(memory / 16,
+                                                          1024 * 1024),
+                                         4096)) {}
+
+  ///
+  /// \brief Build suffix array
+  /// \return File with size + 1 elements of I, the last one is 0
+  ///
+  std::unique_ptr<temp_file> build();
+
+ private:
+  /// Suffix in a round: its group, rank further and position
+  struct tuple {
+    I group;
+    I key;
+    I pos;
+  };
+
+  struct tuple_less {
+    bool operator()(const tuple &a, const tuple &b) const {
+      const value_type a_group = a.group, b_group = b.group;
+      if (a_group != b_group) return a_group < b_group;
+      return static_cast<value_type>(a.key) < static_cast<value_type>(b.key);
+    }
+  };
+
+  /// New rank of suffix
+  struct update {
+    I pos;
+    I rank;
+  };
+
+  struct pos_less {
+    bool operator()(const update &a, const update &b) const {
+      return static_cast<value_type>(a.pos) < static_cast<value_type>(b.pos);
+    }
+  };
+
+  struct rank_less {
+    bool operator()(const update &a, const update &b) const {
+      return static_cast<value_type>(a.rank) <
+             static_cast<value_type>(b.rank);
+    }
+  };
+
+  using tuple_sorter = external_sorter<tuple, tuple_less>;
+  using update_sorter = external_sorter<update, pos_less>;
+
+  /// Sorting key of the first m_key_bytes bytes of suffix
+  value_type first_key(value_type pos, uint32_t bytes) const;
+
+  ///
+  /// \brief Split groups by sorted tuples
+  /// \param tuples  Tuples of unfinished suffixes in order
+  /// \param updates Output, new rank of every suffix of tuples
+  ///
+  void split_groups(tuple_sorter &tuples, update_sorter &updates) const;
+
+  ///
+  /// \brief Write ranks with updates applied
+  /// \param ranks   Ranks of all suffixes, nullptr in the first round
+  /// \param updates New ranks ordered by position
+  /// \return Ranks of all suffixes
+  ///
+  std::unique_ptr<temp_file> apply_updates(const temp_file *ranks,
+                                           update_sorter &updates,
+                                           value_type &unfinished) const;
+
+  const uint8_t *m_str;
+  const value_type m_size;
+  const std::string m_dir;
+  const size_t m_memory;         ///< Memory of each of two sorters
+  const size_t m_buffer_memory;  ///< Memory of sequential readers
+};
+
+template <typename I>
+typename external_sa_builder<I>::value_type
+external_sa_builder<I>::first_key(value_type pos, uint32_t bytes) const {
+  // Byte b is b + 1, end of text is 0, so shorter suffix goes first
+  value_type key = 0;
+  for (uint32_t i = 0; i < bytes; ++i) {
+    const value_type at = pos + static_cast<value_type>(i);
+    key = key * 257 + (at < m_size ? m_str[at] + 1 : 0);
+  }
+  return key;
+}
+
+template <typename I>
+void external_sa_builder<I>::split_groups(tuple_sorter &tuples,
+                                          update_sorter &updates) const {
+  // Lookahead of one tuple tells if subgroup has one suffix
+  tuple current, next;
+  if (!tuples.next(current)) return;
+  bool has_next = true;
+  bool same_as_previous = false;
+  value_type offset = 0;  // Row of current tuple in its group
+  value_type start = 0;   // Row of the first tuple of current subgroup
+  while (has_next) {
+    has_next = tuples.next(next);
+    const bool same_group =
+        has_next && static_cast<value_type>(next.group) ==
+                        static_cast<value_type>(current.group);
+    const bool same_as_next =
+        same_group && static_cast<value_type>(next.key) ==
+                          static_cast<value_type>(current.key);
+    if (!same_as_previous) start = offset;
+    const value_type rank = static_cast<value_type>(current.group) + start;
+    const bool unfinished = same_as_previous || same_as_next;
+    updates.push({current.pos, unfinished ? ~rank : rank});
+    offset = same_group ? offset + 1 : 0;
+    same_as_previous = same_as_next;
+    current = next;
+  }
+}
+
+template <typename I>
+std::unique_ptr<temp_file> external_sa_builder<I>::apply_updates(
+    const temp_file *ranks, update_sorter &updates,
+    value_type &unfinished) const {
+  std::unique_ptr<temp_file> output(new temp_file(m_dir));
+  {
+    record_writer<I> writer(*output, m_buffer_memory);
+    std::unique_ptr<record_reader<I>> reader;
+    if (ranks) {
+      reader.reset(new record_reader<I>(*ranks, 0, m_size, m_buffer_memory));
+    }
+    update next;
+    bool has_update = updates.next(next);
+    unfinished = 0;
+    for (value_type pos = 0; pos < m_size; ++pos) {
+      I rank = 0;
+      if (reader) reader->next(rank);
+      if (has_update && static_cast<value_type>(next.pos) == pos) {
+        rank = next.rank;
+        has_update = updates.next(next);
+      }
+      if (static_cast<value_type>(rank) < 0) ++unfinished;
+      writer.push(rank);
+    }
+  }
+  return output;
+}
+
+template <typename I>
+std::unique_ptr<temp_file> external_sa_builder<I>::build() {
+  // Largest number of bytes whose key fits index type
+  uint32_t key_bytes = 0;
+  for (int64_t limit = index_max<I>(); limit >= 257; limit /= 257) {
+    ++key_bytes;
+  }
+
+  std::unique_ptr<temp_file> ranks;
+  value_type unfinished = 0;
+  {
+    tuple_sorter tuples(m_dir, m_memory);
+    for (value_type pos = 0; pos < m_size; ++pos) {
+      tuples.push({0, first_key(pos, key_bytes), pos});
+    }
+    tuples.sort();
+    update_sorter updates(m_dir, m_memory);
+    split_groups(tuples, updates);
+    updates.sort();
+    ranks = apply_updates(nullptr, updates, unfinished);
+  }
+
+  for (value_type depth = key_bytes; unfinished; depth *= 2) {
+    tuple_sorter tuples(m_dir, m_memory);
+    record_reader<I> reader(*ranks, 0, m_size, m_buffer_memory);
+    record_reader<I> further(*ranks, std::min(depth, m_size),
+                             m_size - std::min(depth, m_size),
+                             m_buffer_memory);
+    for (value_type pos = 0; pos < m_size; ++pos) {
+      I rank = 0;
+      I further_rank = 0;
+      reader.next(rank);
+      value_type key = -1;  // Suffix ends before depth, it goes first
+      if (pos + depth < m_size) {
+        further.next(further_rank);
+        key = static_cast<value_type>(further_rank);
+        if (key < 0) key = ~key;
+      }
+      if (static_cast<value_type>(rank) < 0) {
+        tuples.push({~static_cast<value_type>(rank), key, pos});
+      }
+    }
+    tuples.sort();
+    update_sorter updates(m_dir, m_memory);
+    split_groups(tuples, updates);
+    updates.sort();
+    ranks = apply_updates(ranks.get(), updates, unfinished);
+  }
+
+  // Every suffix has its own row, suffix array is inverse of ranks
+  external_sorter<update, rank_less> rows(m_dir, m_memory);
+  {
+    record_reader<I> reader(*ranks, 0, m_size, m_buffer_memory);
+    for (value_type pos = 0; pos < m_size; ++pos) {
+      I rank = 0;
+      reader.next(rank);
+      rows.push({pos, rank});
+    }
+  }
+  ranks.reset();
+  rows.sort();
+  std::unique_ptr<temp_file> SA(new temp_file(m_dir));
+  {
+    record_writer<I> writer(*SA, m_buffer_memory);
+    update row;
+    while (rows.next(row)) writer.push(row.pos);
+    writer.push(0);
+  }
+  return SA;
+}
+
+#endif  // EXTERNAL_SA_HPP
@@ -0,0 +1,340 @@
+/*-
+ * Copyright 2016 Jakub Nyckowski
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef EXTERNAL_SORT_HPP
+#define EXTERNAL_SORT_HPP
+
+#include "enforce.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+///
+/// \brief Directory of temporary files, TMPDIR or /tmp
+///
+inline std::string default_temp_dir() {
+  const char *dir = std::getenv("TMPDIR");
+  return dir && *dir ? dir : "/tmp";
+}
+
+///
+/// \brief Temporary file on disk, removed as soon as it is created
+///
+/// File has no name, so it disappears when it is closed or the process
+/// ends, even after a crash.
+///
+class temp_file {
+ public:
+  ///
+  /// \param dir Directory where file is created
+  ///
+  explicit temp_file(const std::string &dir) : m_size(0) {
+    std::string path = dir + "/andiffXXXXXX";
+    m_fd = ::mkstemp(&path[0]);
+    enforce(m_fd != -1, "Cannot create temporary file");
+    ::unlink(path.c_str());
+  }
+
+  temp_file(const temp_file &) = delete;
+  temp_file &operator=(const temp_file &) = delete;
+
+  ~temp_file() { ::close(m_fd); }
+
+  ///
+  /// \brief Append data at the end of file
+  ///
+  void append(const void *data, size_t size) {
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    while (size) {
+      ssize_t written = ::pwrite(m_fd, bytes, size, m_size);
+      enforce(written > 0 || (written < 0 && errno == EINTR),
+              "Cannot write temporary file");
+      if (written < 0) continue;
+      bytes += written;
+      size -= static_cast<size_t>(written);
+      m_size += static_cast<uint64_t>(written);
+    }
+  }
+
+  ///
+  /// \brief Read data written before, can be called by many threads
+  ///
+  void read(uint64_t offset, void *data, size_t size) const {
+    uint8_t *bytes = static_cast<uint8_t *>(data);
+    while (size) {
+      ssize_t chunk = ::pread(m_fd, bytes, size, offset);
+      enforce(chunk > 0 || (chunk < 0 && errno == EINTR),
+              "Cannot read temporary file");
+      if (chunk < 0) continue;
+      bytes += chunk;
+      size -= static_cast<size_t>(chunk);
+      offset += static_cast<uint64_t>(chunk);
+    }
+  }
+
+  uint64_t size() const { return m_size; }
+
+ private:
+  int m_fd;         ///< Descriptor of unlinked file
+  uint64_t m_size;  ///< Bytes appended so far
+};
+
+///
+/// \brief Buffered writer of records at the end of temporary file
+///
+template <typename R>
+class record_writer {
+ public:
+  ///
+  /// \param file   Output file
+  /// \param memory Size of buffer in bytes
+  ///
+  record_writer(temp_file &file, size_t memory)
+      : m_file(file), m_buffer(std::max<size_t>(memory / sizeof(R), 1)) {}
+
+  record_writer(const record_writer &) = delete;
+  record_writer &operator=(const record_writer &) = delete;
+
+  ~record_writer() { flush(); }
+
+  void push(const R &record) {
+    if (m_used == m_buffer.size()) flush();
+    m_buffer[m_used++] = record;
+  }
+
+  void flush() {
+    m_file.append(m_buffer.data(), m_used * sizeof(R));
+    m_used = 0;
+  }
+
+ private:
+  temp_file &m_file;
+  std::vector<R> m_buffer;
+  size_t m_used = 0;
+};
+
+///
+/// \brief Buffered reader of consecutive records of temporary file
+///
+template <typename R>
+class record_reader {
+ public:
+  ///
+  /// \param file   Input file
+  /// \param first  First record
+  /// \param count  Number of records
+  /// \param memory Size of buffer in bytes
+  ///
+  record_reader(const temp_file &file, uint64_t first, uint64_t count,
+                size_t memory)
+      : m_file(&file),
+        m_next(first),
+        m_end(first + count),
+        m_buffer(std::max<size_t>(memory / sizeof(R), 1)) {}
+
+  ///
+  /// \brief Get next record
+  /// \return false when all records were read
+  ///
+  bool next(R &record) {
+    if (m_pos == m_used) {
+      if (m_next == m_end) return false;
+      m_used = static_cast<size_t>(
+          std::min<uint64_t>(m_buffer.size(), m_end - m_next));
+      m_file->read(m_next * sizeof(R), m_buffer.data(), m_used * sizeof(R));
+      m_next += m_used;
+      m_pos = 0;
+    }
+    record = m_buffer[m_pos++];
+    return true;
+  }
+
+ private:
+  const temp_file *m_file;
+  uint64_t m_next;  ///< First record which is not in buffer
+  uint64_t m_end;   ///< End of records
+  std::vector<R> m_buffer;
+  size_t m_used = 0;  ///< Records in buffer
+  size_t m_pos = 0;   ///< Next record in buffer
+};
+
+///
+/// \brief Sort of records which do not fit in memory
+///
+/// Records are collected in a buffer of given memory. Full buffer is
+/// sorted and written as a run to temporary file, then runs are merged
+/// while records are read. When there are too many runs to give each a
+/// buffer, groups of them are merged into longer runs first. When all
+/// records fit in the buffer nothing is written to disk.
+///
+template <typename R, typename Less>
+class external_sorter {
+  static_assert(std::is_trivially_copyable<R>::value,
+                "Records are written as raw bytes");
+
+ public:
+  ///
+  /// \param dir    Directory of temporary files
+  /// \param memory Memory of buffer and run readers in bytes
+  /// \param less   Order of records
+  ///
+  external_sorter(const std::string &dir, size_t memory, Less less = Less())
+      : m_dir(dir),
+        m_memory(memory),
+        m_less(less),
+        m_heap(heap_less{less}) {
+    m_buffer.reserve(std::max<size_t>(memory / sizeof(R), 1));
+  }
+
+  void push(const R &record) {
+    if (m_buffer.size() == m_buffer.capacity()) write_run();
+    m_buffer.push_back(record);
+  }
+
+  ///
+  /// \brief Finish adding records, then they are read in order by next()
+  ///
+  void sort() {
+    if (!m_file) {
+      std::sort(m_buffer.begin(), m_buffer.end(), m_less);
+      return;
+    }
+    write_run();
+    std::vector<R>().swap(m_buffer);
+
+    // Too many runs leave too little memory to each of them, then groups
+    // of runs are merged into longer runs first
+    const size_t fan_in = std::max<size_t>(m_memory / min_run_memory, 3) - 1;
+    while (m_runs.size() - 1 > fan_in) merge_pass(fan_in);
+    start_merge(0, m_runs.size() - 1, m_memory / (m_runs.size() - 1));
+  }
+
+  ///
+  /// \brief Get next record in order
+  /// \return false when all records were read
+  ///
+  bool next(R &record) {
+    if (!m_file) {
+      if (m_next == m_buffer.size()) return false;
+      record = m_buffer[m_next++];
+      return true;
+    }
+    return merge_next(record);
+  }
+
+ private:
+  /// Smaller buffers of runs make merge slower than another pass
+  static constexpr size_t min_run_memory = 64 * 1024;
+
+  /// Order of heap, top is the smallest record
+  struct heap_less {
+    Less less;
+    bool operator()(const std::pair<R, size_t> &a,
+                    const std::pair<R, size_t> &b) const {
+      return less(b.first, a.first);
+    }
+  };
+
+  void write_run() {
+    if (!m_file) {
+      m_file.reset(new temp_file(m_dir));
+      m_runs.push_back(0);
+    }
+    std::sort(m_buffer.begin(), m_buffer.end(), m_less);
+    m_file->append(m_buffer.data(), m_buffer.size() * sizeof(R));
+    m_runs.push_back(m_runs.back() + m_buffer.size());
+    m_buffer.clear();
+  }
+
+  /// Start merge of runs [first, last), each one gets memory bytes
+  void start_merge(size_t first, size_t last, size_t memory) {
+    m_readers.clear();
+    for (size_t i = first; i < last; ++i) {
+      m_readers.emplace_back(*m_file, m_runs[i], m_runs[i + 1] - m_runs[i],
+                             memory);
+      R record;
+      if (m_readers.back().next(record)) {
+        m_heap.emplace(record, m_readers.size() - 1);
+      }
+    }
+  }
+
+  bool merge_next(R &record) {
+    if (m_heap.empty()) return false;
+    record = m_heap.top().first;
+    const size_t run = m_heap.top().second;
+    m_heap.pop();
+    R following;
+    if (m_readers[run].next(following)) m_heap.emplace(following, run);
+    return true;
+  }
+
+  /// Merge every fan_in consecutive runs into one run of a new file
+  void merge_pass(size_t fan_in) {
+    std::unique_ptr<temp_file> file(new temp_file(m_dir));
+    std::vector<uint64_t> runs(1, 0);
+    const size_t memory = m_memory / (fan_in + 1);
+    {
+      record_writer<R> writer(*file, memory);
+      for (size_t first = 0; first + 1 < m_runs.size(); first += fan_in) {
+        const size_t last = std::min(first + fan_in, m_runs.size() - 1);
+        start_merge(first, last, memory);
+        R record;
+        while (merge_next(record)) writer.push(record);
+        runs.push_back(runs.back() + m_runs[last] - m_runs[first]);
+      }
+    }
+    m_readers.clear();
+    m_file = std::move(file);
+    m_runs = std::move(runs);
+  }
+
+  const std::string m_dir;
+  const size_t m_memory;
+  Less m_less;
+  std::vector<R> m_buffer;  ///< Records of next run
+  size_t m_next = 0;        ///< Next record when nothing was written
+  std::unique_ptr<temp_file> m_file;  ///< Runs one after another
+  std::vector<uint64_t> m_runs;       ///< First record of every run, end
+  std::vector<record_reader<R>> m_readers;
+  std::priority_queue<std::pair<R, size_t>, std::vector<std::pair<R, size_t>>,
+                      heap_less>
+      m_heap;  ///< Smallest unread record of every run being merged
+};
+
+#endif  // EXTERNAL_SORT_HPP
@@ -28,6 +28,7 @@
 #define FILE_MAPED_ARRAY_HPP
 
 #include "enforce.hpp"
+#include "mapped_file.hpp"
 #include "readers.hpp"
 #include "writers.hpp"
 
@@ -74,13 +75,21 @@ class file_mapped_array {
   ///
   block_type& operator[](size_t pos);
 
+  ///
+  /// \brief Get contiguous part of underlying file
+  /// \param pos  Position of first element
+  /// \param size Number of elements, buffer grows if it is too small
+  /// \return Pointer valid until next call of any access method
+  ///
+  const block_type* span(size_t pos, size_t size);
+
  private:
   void fill_data(size_t pos);
 
   std::unique_ptr<block_type[]> m_data;  ///< Internal data buffer
   size_t m_offset;     ///< Offset of read data from the beginning of file
   size_t m_cache_end;  ///< End of read cache
-  const size_t m_buffer_size;  ///< Size of buffer
+  size_t m_buffer_size;        ///< Size of buffer
   T m_reader;                  ///< Source of data
 };
 
@@ -105,23 +114,85 @@ file_mapped_array<T, block_type>::file_mapped_array(
 
 template <typename T, typename block_type>
 block_type& file_mapped_array<T, block_type>::operator[](size_t pos) {
-  if (!(pos >= m_offset && pos < m_offset + m_buffer_size)) {
+  if (!(pos >= m_offset && pos < m_cache_end)) {
     fill_data(pos);
   }
   return m_data[pos - m_offset];
 }
 
+template <typename T, typename block_type>
+const block_type* file_mapped_array<T, block_type>::span(size_t pos,
+                                                         size_t size) {
+  if (!(pos >= m_offset && pos + size <= m_cache_end)) {
+    if (size > m_buffer_size) {
+      m_data.reset(new block_type[size]);
+      m_buffer_size = size;
+    }
+    fill_data(pos);
+    enforce_throw(pos + size <= m_cache_end, "Read beyond end of file");
+  }
+  return m_data.get() + (pos - m_offset);
+}
+
 template <typename T, typename block_type>
 void file_mapped_array<T, block_type>::fill_data(size_t pos) {
   m_reader.seek(pos);
 
   size_t read = m_reader.read(m_data.get(), m_buffer_size);
-  enforce(read > 0, "read error");
+  enforce_throw(read > 0, "read error");
   m_offset = pos;
   m_cache_end = m_offset + read;
 }
 
 typedef file_mapped_array<file_reader, std::uint8_t> file_array;
-typedef file_mapped_array<anpatch_reader, std::uint8_t> bz2_array;
+
+///
+/// \brief Read-only random access to old file
+///
+/// File is mapped into memory when possible, so spans are handed out without
+/// any copy or system call. When mapping fails (e.g. file does not fit into
+/// address space) data are read through file_array buffer.
+///
+class old_file_array {
+ public:
+  ///
+  /// \brief Constructor
+  /// \param file_name   Path to file
+  /// \param buffer_size Initial buffer size used when file cannot be mapped
+  ///
+  explicit old_file_array(const std::string& file_name,
+                          size_t buffer_size = 1024 * 1024) {
+    if (m_mapped.try_map(file_name)) {
+      m_mapped.advise(MADV_WILLNEED);
+      m_size = m_mapped.size();
+    } else {
+      file_reader reader;
+      reader.open(file_name);
+      m_size = static_cast<size_t>(reader.size());
+      reader.close();
+      m_buffered.reset(new file_array(file_name, buffer_size));
+    }
+  }
+
+  ///
+  /// \brief Get contiguous part of old file
+  /// \param pos  Position of first byte
+  /// \param size Number of bytes
+  /// \return Pointer valid until next call of span
+  ///
+  const std::uint8_t* span(int64_t pos, size_t size) {
+    enforce_throw(pos >= 0 && static_cast<size_t>(pos) + size <= m_size,
+                  "Corrupt patch, old file position out of range");
+    if (!m_buffered) return m_mapped.data() + pos;
+    return m_buffered->span(static_cast<size_t>(pos), size);
+  }
+
+  size_t size() const { return m_size; }
+
+ private:
+  mapped_file m_mapped;                    ///< Mapping of old file
+  std::unique_ptr<file_array> m_buffered;  ///< Used if mapping failed
+  size_t m_size;                           ///< Size of old file
+};
 
 #endif  // FILE_MAPED_ARRAY_HPP
@@ -0,0 +1,379 @@
+/*-
+ * Copyright 2016 Jakub Nyckowski
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef FM_INDEX_HPP
+#define FM_INDEX_HPP
+
+#include "enforce.hpp"
+#include "external_sa.hpp"
+#include "external_sort.hpp"
+#include "generate_sa.hpp"
+#include "index_array.hpp"
+#include "index_file.hpp"
+#include "mapped_file.hpp"
+#include "matchlen.hpp"
+#include "simd.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+///
+/// \brief FM-index with sampled suffix array
+///
+/// Index is built for reversed text, so every step of backward search
+/// extends the pattern by one byte on the right and the longest prefix of
+/// a pattern is found without knowing its length in advance.
+///
+/// Occurrences of every byte are counted in two levels: absolute counts
+/// every 64K rows and 16-bit counts relative to them every 512 rows. The
+/// rest is counted directly in BWT. Suffix array is sampled at text
+/// positions divisible by sample_rate. For 8-byte T whole index takes
+/// about 2.5 bytes per text byte, instead of 8 bytes of suffix array.
+///
+/// build() needs the whole suffix array of reversed text in memory, so its
+/// peak is higher than the one of plain suffix array search. Only
+/// build_external() keeps suffix array on disk and stays within a limit.
+///
+/// Matches are as long as matches of suffix array search, but when text
+/// has many of them a different one may be chosen.
+///
+template <typename T>
+class fm_index {
+ public:
+  /// Every sample_rate-th text position keeps its suffix array value
+  static const T sample_rate = 32;
+  /// Range of at most locate_limit rows is extended directly in text
+  static const T locate_limit = 4;
+
+  ///
+  /// \brief Build index of reversed text
+  /// \tparam I             Index type of suffix array of reversed text
+  /// \param text           Text, it is needed later by longest_match()
+  /// \param builder        Algorithm of suffix array of reversed text
+  /// \param threads_number Threads of parallel builder
+  ///
+  template <typename I>
+  void build(data_view text, sa_builder_id builder, uint32_t threads_number);
+
+  ///
+  /// \brief Build index of reversed text with suffix array on disk
+  /// Besides text, memory holds reversed text and BWT, both of its size.
+  /// \tparam I      Index type of suffix array of reversed text
+  /// \param text    Text, it is needed later by longest_match()
+  /// \param dir     Directory of temporary files
+  /// \param memory  Memory of suffix array construction
+  ///
+  template <typename I>
+  void build_external(data_view text, const std::string &dir, size_t memory);
+
+  ///
+  /// \brief Find the longest prefix of pattern which occurs in text
+  /// \param text         Text used to build index
+  /// \param pattern      Pattern to find
+  /// \param pattern_size Size of pattern
+  /// \param pos          Output position of match in text
+  /// \return Length of match
+  ///
+  T longest_match(data_view text, const uint8_t *pattern, T pattern_size,
+                  T *pos) const;
+
+  ///
+  /// \brief Add arrays of index to index file
+  ///
+  void save(index_writer &writer) const;
+
+  ///
+  /// \brief Use arrays stored by save()
+  /// \param reader Opened index file
+  /// \param first  Index of first array
+  /// \param size   Size of text
+  ///
+  void load(const index_reader &reader, size_t first, size_t size);
+
+ private:
+  static const unsigned block_bits = 9;
+  static const unsigned super_bits = 16;
+
+  ///
+  /// \brief Fill BWT and sampled suffix array
+  /// \param reversed Reversed text
+  /// \param next_sa  Returns suffix array values of reversed text in order
+  ///
+  template <typename next_value>
+  void scan_suffix_array(const std::vector<uint8_t> &reversed,
+                         next_value next_sa);
+
+  /// Fill occurrence tables from BWT and rank of sampled rows from marks
+  void count_occurrences();
+
+  /// Number of occurrences of c in BWT before row
+  T occ(uint8_t c, T row) const;
+
+  /// Row of suffix one position before suffix of row
+  T lf(T row) const;
+
+  /// Suffix array value of row
+  T locate(T row) const;
+
+  index_array<uint8_t> m_bwt;     ///< BWT, sentinel row holds 0
+  index_array<T> m_counts;        ///< Rows before byte, then sentinel row
+  index_array<T> m_super;         ///< Occurrences before every 64K rows
+  index_array<uint16_t> m_block;  ///< Occurrences since 64K row, per 512
+  index_array<uint64_t> m_marks;  ///< Bit for every sampled row
+  index_array<T> m_mark_rank;     ///< Sampled rows before every word
+  index_array<T> m_samples;       ///< Suffix array of sampled rows
+  T m_primary = 0;                ///< Sentinel row
+};
+
+template <typename T>
+const T fm_index<T>::sample_rate;
+
+template <typename T>
+const T fm_index<T>::locate_limit;
+
+template <typename T>
+template <typename I>
+void fm_index<T>::build(data_view text, sa_builder_id builder,
+                        uint32_t threads_number) {
+  std::vector<uint8_t> reversed(text.begin(), text.end());
+  std::reverse(reversed.begin(), reversed.end());
+  {
+    index_array<I> sa = make_suffix_array<I>(builder, reversed.data(),
+                                             reversed.size(), threads_number);
+    size_t row = 0;
+    scan_suffix_array(reversed, [&]() { return static_cast<T>(sa[row++]); });
+  }
+  reversed = std::vector<uint8_t>();
+  count_occurrences();
+}
+
+template <typename T>
+template <typename I>
+void fm_index<T>::build_external(data_view text, const std::string &dir,
+                                 size_t memory) {
+  std::vector<uint8_t> reversed(text.begin(), text.end());
+  std::reverse(reversed.begin(), reversed.end());
+  {
+    std::unique_ptr<temp_file> file =
+        external_sa_builder<I>(reversed.data(), reversed.size(), dir, memory)
+            .build();
+    record_reader<I> sa(*file, 0, reversed.size(),
+                        std::min<size_t>(memory, 1024 * 1024));
+    scan_suffix_array(reversed, [&]() {
+      I value = 0;
+      sa.next(value);
+      return static_cast<T>(value);
+    });
+  }
+  reversed = std::vector<uint8_t>();
+  count_occurrences();
+}
+
+template <typename T>
+template <typename next_value>
+void fm_index<T>::scan_suffix_array(const std::vector<uint8_t> &reversed,
+                                    next_value next_sa) {
+  const T n = static_cast<T>(reversed.size());
+  const T rows = n + 1;
+
+  // Row 0 is the suffix made of sentinel alone
+  std::vector<uint8_t> bwt(static_cast<size_t>(rows));
+  std::vector<uint64_t> marks(static_cast<size_t>(rows / 64 + 1));
+  std::vector<T> samples;
+  samples.reserve(static_cast<size_t>(n / sample_rate + 2));
+  for (T row = 0; row < rows; ++row) {
+    T p = row ? next_sa() : n;
+    if (p == 0) {
+      m_primary = row;
+    } else {
+      bwt[row] = reversed[p - 1];
+    }
+    if (p % sample_rate == 0) {
+      marks[row / 64] |= 1ULL << (row % 64);
+      samples.push_back(p);
+    }
+  }
+  m_bwt = index_array<uint8_t>(std::move(bwt));
+  m_marks = index_array<uint64_t>(std::move(marks));
+  m_samples = index_array<T>(std::move(samples));
+}
+
+template <typename T>
+void fm_index<T>::count_occurrences() {
+  const T rows = static_cast<T>(m_bwt.size());
+
+  std::vector<T> mark_rank(m_marks.size());
+  T marked = 0;
+  for (size_t i = 0; i < m_marks.size(); ++i) {
+    mark_rank[i] = marked;
+    marked += static_cast<T>(__builtin_popcountll(m_marks[i]));
+  }
+
+  // Tables have entries also for row == rows, the end of search range
+  std::vector<T> super((static_cast<size_t>(rows >> super_bits) + 1) * 256);
+  std::vector<uint16_t> block((static_cast<size_t>(rows >> block_bits) + 1) *
+                              256);
+  std::array<T, 256> running = {};
+  for (T row = 0; row <= rows; ++row) {
+    if (row % (T(1) << super_bits) == 0) {
+      std::copy(running.begin(), running.end(),
+                super.begin() + (row >> super_bits) * 256);
+    }
+    if (row % (T(1) << block_bits) == 0) {
+      const T *base = &super[(row >> super_bits) * 256];
+      for (size_t c = 0; c < 256; ++c) {
+        block[(row >> block_bits) * 256 + c] =
+            static_cast<uint16_t>(running[c] - base[c]);
+      }
+    }
+    if (row < rows && row != m_primary) ++running[m_bwt[row]];
+  }
+
+  std::vector<T> counts(257);
+  T total = 1;  // Sentinel row
+  for (size_t c = 0; c < 256; ++c) {
+    counts[c] = total;
+    total += running[c];
+  }
+  counts[256] = m_primary;
+
+  m_counts = index_array<T>(std::move(counts));
+  m_super = index_array<T>(std::move(super));
+  m_block = index_array<uint16_t>(std::move(block));
+  m_mark_rank = index_array<T>(std::move(mark_rank));
+}
+
+template <typename T>
+void fm_index<T>::save(index_writer &writer) const {
+  writer.add(m_bwt.data(), m_bwt.size());
+  writer.add(m_counts.data(), m_counts.size());
+  writer.add(m_super.data(), m_super.size());
+  writer.add(m_block.data(), m_block.size());
+  writer.add(m_marks.data(), m_marks.size());
+  writer.add(m_mark_rank.data(), m_mark_rank.size());
+  writer.add(m_samples.data(), m_samples.size());
+}
+
+template <typename T>
+void fm_index<T>::load(const index_reader &reader, size_t first,
+                       size_t size) {
+  m_bwt = reader.template array<uint8_t>(first);
+  m_counts = reader.template array<T>(first + 1);
+  m_super = reader.template array<T>(first + 2);
+  m_block = reader.template array<uint16_t>(first + 3);
+  m_marks = reader.template array<uint64_t>(first + 4);
+  m_mark_rank = reader.template array<T>(first + 5);
+  m_samples = reader.template array<T>(first + 6);
+
+  const size_t rows = size + 1;
+  enforce(m_bwt.size() == rows && m_counts.size() == 257 &&
+              m_super.size() == ((rows >> super_bits) + 1) * 256 &&
+              m_block.size() == ((rows >> block_bits) + 1) * 256 &&
+              m_marks.size() == rows / 64 + 1 &&
+              m_mark_rank.size() == m_marks.size(),
+          "Index has wrong size");
+  m_primary = m_counts[256];
+}
+
+template <typename T>
+T fm_index<T>::occ(uint8_t c, T row) const {
+  const T block_start = (row >> block_bits) << block_bits;
+  T count = m_super[(row >> super_bits) * 256 + c] +
+            m_block[(row >> block_bits) * 256 + c] +
+            static_cast<T>(count_byte(m_bwt.data() + block_start,
+                                      static_cast<size_t>(row - block_start),
+                                      c));
+  // Sentinel is stored as 0, but it is not an occurrence
+  if (c == 0 && m_primary >= block_start && m_primary < row) --count;
+  return count;
+}
+
+template <typename T>
+T fm_index<T>::lf(T row) const {
+  uint8_t c = m_bwt[row];
+  return m_counts[c] + occ(c, row);
+}
+
+template <typename T>
+T fm_index<T>::locate(T row) const {
+  T steps = 0;
+  for (;;) {
+    uint64_t word = m_marks[row / 64];
+    uint64_t bit = 1ULL << (row % 64);
+    if (word & bit) {
+      T rank = m_mark_rank[row / 64] +
+               static_cast<T>(__builtin_popcountll(word & (bit - 1)));
+      return m_samples[rank] + steps;
+    }
+    // Sentinel row is always sampled, so LF is never applied to it
+    row = lf(row);
+    ++steps;
+  }
+}
+
+template <typename T>
+T fm_index<T>::longest_match(data_view text, const uint8_t *pattern,
+                             T pattern_size, T *pos) const {
+  const T n = static_cast<T>(text.size());
+  T sp = 0;
+  T ep = n + 1;
+  T len = 0;
+  while (len < pattern_size && ep - sp > locate_limit) {
+    uint8_t c = pattern[len];
+    T next_sp = m_counts[c] + occ(c, sp);
+    T next_ep = m_counts[c] + occ(c, ep);
+    if (next_sp >= next_ep) break;
+    sp = next_sp;
+    ep = next_ep;
+    ++len;
+  }
+
+  // Match in reversed text at q is match in text at n - q - len
+  if (ep - sp > locate_limit) {
+    *pos = n - locate(sp) - len;
+    return len;
+  }
+
+  // Few occurrences left, extend all of them directly in text
+  T best = -1;
+  for (T row = sp; row < ep; ++row) {
+    T p = n - locate(row) - len;
+    T match = len + matchlen(text.data() + p + len, n - p - len,
+                             pattern + len, pattern_size - len);
+    if (match > best) {
+      best = match;
+      *pos = p;
+    }
+  }
+  return best;
+}
+
+#endif  // FM_INDEX_HPP
@@ -27,10 +27,20 @@
 #ifndef GENERATE_SA_HPP
 #define GENERATE_SA_HPP
 
+#include "enforce.hpp"
+#include "index_array.hpp"
+#include "int40.hpp"
+#include "parallel_sa.hpp"
+
 #include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
 
 #include <divsufsort.h>
 #include <divsufsort64.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 template <typename T>
 inline int32_t generate_suffix_array(const uint8_t *str, T *SA, T str_size);
@@ -47,4 +57,92 @@ inline int32_t generate_suffix_array<int64_t>(const uint8_t *str, int64_t *SA,
   return divsufsort64(str, SA, str_size);
 }
 
+/// Algorithms which build suffix array
+enum class sa_builder_id : uint8_t { divsufsort = 0, parallel = 1 };
+
+///
+/// \brief Get suffix array builder by its name
+/// \param name Name of builder
+/// \return Builder identifier
+///
+inline sa_builder_id sa_builder_from_name(const std::string &name) {
+  if (name == "divsufsort") return sa_builder_id::divsufsort;
+  if (name == "parallel") return sa_builder_id::parallel;
+  throw std::invalid_argument("Unknown suffix array builder: " + name);
+}
+
+///
+/// \brief Build suffix array with chosen algorithm
+/// \param builder        Algorithm
+/// \param str            Text
+/// \param SA             Output suffix array of str_size elements
+/// \param str_size       Size of text
+/// \param threads_number Threads used by parallel builder; divsufsort uses
+///                       OpenMP when it was compiled with it
+/// \return 0 on success
+///
+template <typename T>
+inline int32_t build_suffix_array(sa_builder_id builder, const uint8_t *str,
+                                  T *SA, T str_size,
+                                  uint32_t threads_number) {
+  switch (builder) {
+    case sa_builder_id::divsufsort:
+      return generate_suffix_array<T>(str, SA, str_size);
+    case sa_builder_id::parallel:
+      parallel_sa_builder<T>(str, SA, str_size, threads_number).build();
+      return 0;
+  }
+  return -1;
+}
+
+///
+/// \brief Build suffix array of index type T
+/// \param builder        Algorithm
+/// \param str            Text
+/// \param size           Size of text
+/// \param threads_number Threads used by parallel builder
+/// \return Suffix array of size + 1 rows, the last one holds 0
+///
+template <typename T>
+index_array<T> make_suffix_array(sa_builder_id builder, const uint8_t *str,
+                                 size_t size, uint32_t threads_number) {
+  std::vector<T> SA(size + 1);
+  int sa_result = build_suffix_array<T>(builder, str, SA.data(),
+                                        static_cast<T>(size), threads_number);
+  enforce(sa_result == 0, "Generating suffix array failed");
+  return index_array<T>(std::move(SA));
+}
+
+///
+/// \brief Build packed suffix array
+/// Builders work on 64-bit positions, so construction still needs 8 bytes
+/// per position at its peak; only the result keeps 5 bytes. Positions are
+/// packed in the same memory, which is mapped directly, so pages behind
+/// packed array are unmapped without help of allocator.
+///
+template <>
+inline index_array<int40_t> make_suffix_array<int40_t>(
+    sa_builder_id builder, const uint8_t *str, size_t size,
+    uint32_t threads_number) {
+  const size_t rows = size + 1;
+  const size_t page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+  const size_t wide_bytes = (rows * sizeof(int64_t) + page - 1) / page * page;
+  void *memory = ::mmap(nullptr, wide_bytes, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  enforce(memory != MAP_FAILED, "Cannot allocate suffix array");
+  int sa_result = build_suffix_array<int64_t>(
+      builder, str, static_cast<int64_t *>(memory),
+      static_cast<int64_t>(size), threads_number);
+  enforce(sa_result == 0, "Generating suffix array failed");
+  pack_int40(memory, rows);
+
+  const size_t packed_bytes = (rows * sizeof(int40_t) + page - 1) / page * page;
+  if (packed_bytes < wide_bytes) {
+    ::munmap(static_cast<uint8_t *>(memory) + packed_bytes,
+             wide_bytes - packed_bytes);
+  }
+  return index_array<int40_t>::adopt_pages(static_cast<int40_t *>(memory),
+                                           packed_bytes, rows);
+}
+
 #endif  // GENERATE_SA_HPP
@@ -0,0 +1,173 @@
+/*-
+ * Copyright 2016 Jakub Nyckowski
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef HASH_INDEX_HPP
+#define HASH_INDEX_HPP
+
+#include "enforce.hpp"
+#include "index_array.hpp"
+#include "index_file.hpp"
+#include "mapped_file.hpp"
+#include "matchlen.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+///
+/// \brief Hash table of fixed blocks of old file
+///
+/// Like in rsync, old file is split into blocks of block_size bytes and
+/// hash of every block is stored in an open addressing table. Window of
+/// new file at any position is matched when it equals one of the blocks,
+/// then the match is extended with matchlen. Only matches which contain
+/// a whole block are found, in exchange table takes 2 / block_size of
+/// suffix array memory and is built in one pass.
+///
+template <typename T>
+class hash_index {
+ public:
+  /// Size of indexed blocks, the shortest match which can be found
+  static const T block_size = 32;
+
+  ///
+  /// \brief Build table of blocks of text
+  /// \param text Text, it is needed later by longest_match()
+  ///
+  void build(data_view text);
+
+  ///
+  /// \brief Find match of pattern prefix which covers a whole block
+  /// \param text         Text used to build table
+  /// \param pattern      Pattern to find
+  /// \param pattern_size Size of pattern
+  /// \param pos          Output position of match in text
+  /// \return Length of match, 0 when window is not in table
+  ///
+  T longest_match(data_view text, const uint8_t *pattern, T pattern_size,
+                  T *pos) const;
+
+  ///
+  /// \brief Add table to index file
+  ///
+  void save(index_writer &writer) const;
+
+  ///
+  /// \brief Use table stored by save()
+  /// \param reader Opened index file
+  /// \param first  Index of table array
+  /// \param size   Size of text
+  ///
+  void load(const index_reader &reader, size_t first, size_t size);
+
+ private:
+  /// Number of slots for text of size bytes, at most half of them is used
+  static size_t table_size(size_t size);
+
+  /// Hash of block_size bytes
+  static uint64_t block_hash(const uint8_t *data);
+
+  index_array<T> m_table;  ///< Block positions, -1 in empty slots
+  size_t m_mask = 0;       ///< Table size minus one
+};
+
+template <typename T>
+const T hash_index<T>::block_size;
+
+template <typename T>
+size_t hash_index<T>::table_size(size_t size) {
+  size_t slots = 1;
+  while (slots < 2 * (size / block_size)) slots <<= 1;
+  return slots;
+}
+
+template <typename T>
+uint64_t hash_index<T>::block_hash(const uint8_t *data) {
+  uint64_t hash = 0;
+  for (T i = 0; i < block_size; i += 8) {
+    uint64_t word;
+    std::memcpy(&word, data + i, sizeof(word));
+    hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+    hash ^= hash >> 29;
+  }
+  return hash;
+}
+
+template <typename T>
+void hash_index<T>::build(data_view text) {
+  const T size = static_cast<T>(text.size());
+  std::vector<T> table(table_size(text.size()), -1);
+  m_mask = table.size() - 1;
+
+  for (T block = 0; block + block_size <= size; block += block_size) {
+    const uint8_t *data = text.data() + block;
+    size_t slot = block_hash(data) & m_mask;
+    // Keep only the first of equal blocks, e.g. runs of zeros
+    while (table[slot] >= 0 &&
+           std::memcmp(text.data() + table[slot], data, block_size) != 0) {
+      slot = (slot + 1) & m_mask;
+    }
+    if (table[slot] < 0) table[slot] = block;
+  }
+  m_table = index_array<T>(std::move(table));
+}
+
+template <typename T>
+T hash_index<T>::longest_match(data_view text, const uint8_t *pattern,
+                               T pattern_size, T *pos) const {
+  *pos = 0;
+  if (pattern_size < block_size) return 0;
+
+  const T size = static_cast<T>(text.size());
+  for (size_t slot = block_hash(pattern) & m_mask; m_table[slot] >= 0;
+       slot = (slot + 1) & m_mask) {
+    const T block = m_table[slot];
+    if (std::memcmp(text.data() + block, pattern, block_size) == 0) {
+      *pos = block;
+      return block_size + matchlen(text.data() + block + block_size,
+                                   size - block - block_size,
+                                   pattern + block_size,
+                                   pattern_size - block_size);
+    }
+  }
+  return 0;
+}
+
+template <typename T>
+void hash_index<T>::save(index_writer &writer) const {
+  writer.add(m_table.data(), m_table.size());
+}
+
+template <typename T>
+void hash_index<T>::load(const index_reader &reader, size_t first,
+                         size_t size) {
+  m_table = reader.template array<T>(first);
+  enforce(m_table.size() == table_size(size), "Index has wrong size");
+  m_mask = m_table.size() - 1;
+}
+
+#endif  // HASH_INDEX_HPP
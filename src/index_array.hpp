@@ -0,0 +1,130 @@
+/*-
+ * Copyright 2016 Jakub Nyckowski
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef INDEX_ARRAY_HPP
+#define INDEX_ARRAY_HPP
+
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+
+///
+/// \brief Array of index data, owned or borrowed from a mapped index file
+///
+/// Arrays built in memory own their storage, a vector or pages mapped
+/// directly. Arrays loaded from an index file point into its mapping,
+/// which has to outlive them, and are read-only.
+///
+template <typename T>
+class index_array {
+ public:
+  index_array() : m_data(nullptr), m_size(0) {}
+
+  explicit index_array(size_t size)
+      : m_owned(size), m_data(m_owned.data()), m_size(size) {}
+
+  explicit index_array(std::vector<T> &&data)
+      : m_owned(std::move(data)), m_data(m_owned.data()),
+        m_size(m_owned.size()) {}
+
+  index_array(const index_array &) = delete;
+  index_array &operator=(const index_array &) = delete;
+
+  index_array(index_array &&other) noexcept { *this = std::move(other); }
+
+  index_array &operator=(index_array &&other) noexcept {
+    m_owned = std::move(other.m_owned);
+    m_pages = std::move(other.m_pages);
+    m_data = other.m_data;
+    m_size = other.m_size;
+    other.m_data = nullptr;
+    other.m_size = 0;
+    return *this;
+  }
+
+  ///
+  /// \brief Create array borrowing memory
+  /// \param data Beginning of array
+  /// \param size Number of elements
+  /// \return Non-owning array
+  ///
+  static index_array borrow(const T *data, size_t size) {
+    index_array array;
+    array.m_data = const_cast<T *>(data);
+    array.m_size = size;
+    return array;
+  }
+
+  ///
+  /// \brief Create array owning anonymous mapping, unmapped with the array
+  /// \param data  Beginning of mapping
+  /// \param bytes Size of mapping
+  /// \param size  Number of elements
+  /// \return Owning array
+  ///
+  static index_array adopt_pages(T *data, size_t bytes, size_t size) {
+    index_array array;
+    array.m_pages = std::unique_ptr<T, pages_deleter>(data, {bytes});
+    array.m_data = data;
+    array.m_size = size;
+    return array;
+  }
+
+  ///
+  /// \brief Writable data, only for owned arrays
+  ///
+  T *data() { return m_data; }
+
+  const T *data() const { return m_data; }
+
+  size_t size() const { return m_size; }
+
+  const T &operator[](size_t pos) const { return m_data[pos]; }
+
+  /// Hint that element will be read soon
+  void prefetch(size_t pos) const { __builtin_prefetch(m_data + pos); }
+
+  const T *begin() const { return m_data; }
+
+  const T *end() const { return m_data + m_size; }
+
+ private:
+  /// Unmaps pages of adopt_pages()
+  struct pages_deleter {
+    size_t bytes;
+    void operator()(T *data) const { ::munmap(data, bytes); }
+  };
+
+  std::vector<T> m_owned;                     ///< Storage of owned array
+  std::unique_ptr<T, pages_deleter> m_pages;  ///< Mapped storage
+  T *m_data;                                  ///< Beginning of array
+  size_t m_size;                              ///< Number of elements
+};
+
+#endif  // INDEX_ARRAY_HPP
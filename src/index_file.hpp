@@ -0,0 +1,265 @@
+/*-
+ * Copyright 2016 Jakub Nyckowski
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef INDEX_FILE_HPP
+#define INDEX_FILE_HPP
+
+#include "checksum.hpp"
+#include "enforce.hpp"
+#include "index_array.hpp"
+#include "mapped_file.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// Magic sequence of index file
+static constexpr char andiff_index_magic[16] = "ANDIFFIDX";
+
+/// Changed whenever layout of index file or meaning of arrays changes
+static constexpr uint32_t andiff_index_version = 5;
+
+/// Maximum number of arrays in one index
+static constexpr size_t andiff_index_max_arrays = 8;
+
+/// Arrays start at page boundary, so they can be used straight from mapping
+static constexpr uint64_t andiff_index_alignment = 4096;
+
+///
+/// \brief Header at the beginning of index file
+///
+/// Index is stored in native byte order. It is valid only for the same old
+/// file, the same index type and the same diff class.
+///
+struct index_header {
+  struct array_entry {
+    uint64_t offset;    ///< Position of array in file
+    uint64_t size;      ///< Size of array in bytes
+    uint64_t checksum;  ///< checksum64 of array data
+  };
+
+  char magic[16];
+  uint32_t version;
+  uint32_t byte_order;    ///< 0x01020304 written in native order
+  uint32_t element_size;  ///< Size of index type: 4, 5 or 8
+  uint32_t kind;          ///< Diff class which built the index
+  uint64_t source_size;
+  uint64_t source_checksum;
+  uint64_t array_count;
+  array_entry arrays[andiff_index_max_arrays];
+  uint64_t header_checksum;  ///< checksum64 of all fields above
+};
+
+static_assert(std::is_trivially_copyable<index_header>::value,
+              "Index header is written as raw bytes");
+
+inline uint64_t index_header_checksum(const index_header &header) {
+  return checksum64(&header, offsetof(index_header, header_checksum));
+}
+
+///
+/// \brief Writes arrays of index to file
+///
+/// Arrays are not copied, they have to live until write() returns.
+///
+class index_writer {
+ public:
+  ///
+  /// \param element_size    Size of index type
+  /// \param kind            Diff class which built the index
+  /// \param source_size     Size of old file
+  /// \param source_checksum checksum64 of old file
+  ///
+  index_writer(uint32_t element_size, uint32_t kind, uint64_t source_size,
+               uint64_t source_checksum) {
+    std::memset(&m_header, 0, sizeof(m_header));
+    std::memcpy(m_header.magic, andiff_index_magic, sizeof(m_header.magic));
+    m_header.version = andiff_index_version;
+    m_header.byte_order = 0x01020304;
+    m_header.element_size = element_size;
+    m_header.kind = kind;
+    m_header.source_size = source_size;
+    m_header.source_checksum = source_checksum;
+  }
+
+  ///
+  /// \brief Add array to index
+  /// \param data  Beginning of array
+  /// \param count Number of elements
+  ///
+  template <typename T>
+  void add(const T *data, size_t count) {
+    enforce(m_header.array_count < andiff_index_max_arrays,
+            "Too many index arrays");
+    m_data.push_back(reinterpret_cast<const uint8_t *>(data));
+    auto &entry = m_header.arrays[m_header.array_count++];
+    entry.size = count * sizeof(T);
+    entry.checksum = checksum64(data, entry.size);
+    m_sizes.push_back(entry.size);
+  }
+
+  ///
+  /// \brief Write index file
+  /// File is written under temporary name and renamed, so concurrent
+  /// readers never see partial index.
+  /// \param file_path Path to index file
+  ///
+  void write(const std::string &file_path) {
+    uint64_t offset = align(sizeof(index_header));
+    for (size_t i = 0; i < m_data.size(); ++i) {
+      m_header.arrays[i].offset = offset;
+      offset = align(offset + m_sizes[i]);
+    }
+    m_header.header_checksum = index_header_checksum(m_header);
+
+    std::string tmp_path = file_path + ".XXXXXX";
+    int fd = ::mkstemp(&tmp_path[0]);
+    enforce(fd != -1, "Cannot create index file");
+    // Index is meant to be shared, do not keep private mode of mkstemp
+    ::fchmod(fd, 0644);
+    FILE *file = ::fdopen(fd, "wb");
+    enforce(file != nullptr, "Cannot create index file");
+
+    bool ok = write_padded(file, &m_header, sizeof(m_header));
+    for (size_t i = 0; ok && i < m_data.size(); ++i) {
+      ok = write_padded(file, m_data[i], m_sizes[i]);
+    }
+    ok = ::fclose(file) == 0 && ok;
+    if (ok) ok = ::rename(tmp_path.c_str(), file_path.c_str()) == 0;
+    if (!ok) ::unlink(tmp_path.c_str());
+    enforce(ok, "Cannot write index file");
+  }
+
+ private:
+  static uint64_t align(uint64_t offset) {
+    return (offset + andiff_index_alignment - 1) / andiff_index_alignment *
+           andiff_index_alignment;
+  }
+
+  static bool write_padded(FILE *file, const void *data, size_t size) {
+    static const uint8_t zeros[andiff_index_alignment] = {};
+    if (size && ::fwrite(data, size, 1, file) != 1) return false;
+    size_t padding = align(size) - size;
+    return !padding || ::fwrite(zeros, padding, 1, file) == 1;
+  }
+
+  index_header m_header;
+  std::vector<const uint8_t *> m_data;
+  std::vector<size_t> m_sizes;
+};
+
+///
+/// \brief Maps index file and checks it matches the old file
+///
+class index_reader {
+ public:
+  index_reader() { std::memset(&m_header, 0, sizeof(m_header)); }
+
+  ///
+  /// \brief Open index, report why it cannot be used
+  /// \param file_path       Path to index file
+  /// \param element_size    Expected size of index type
+  /// \param kind            Expected diff class
+  /// \param source_size     Size of old file
+  /// \param source_checksum checksum64 of old file
+  /// \return true if index can be used, false if it has to be rebuilt
+  ///
+  bool open(const std::string &file_path, uint32_t element_size,
+            uint32_t kind, uint64_t source_size, uint64_t source_checksum) {
+    if (::access(file_path.c_str(), F_OK) != 0) return false;
+    if (!m_file.try_map(file_path) || m_file.size() < sizeof(index_header)) {
+      return reject("cannot be read");
+    }
+    std::memcpy(&m_header, m_file.data(), sizeof(m_header));
+
+    if (std::memcmp(m_header.magic, andiff_index_magic,
+                    sizeof(m_header.magic)) != 0 ||
+        m_header.header_checksum != index_header_checksum(m_header)) {
+      return reject("is corrupted");
+    }
+    if (m_header.version != andiff_index_version ||
+        m_header.byte_order != 0x01020304) {
+      return reject("has different version");
+    }
+    if (m_header.element_size != element_size || m_header.kind != kind) {
+      return reject("was built with different options");
+    }
+    if (m_header.source_size != source_size ||
+        m_header.source_checksum != source_checksum) {
+      return reject("was built for different old file");
+    }
+    if (m_header.array_count > andiff_index_max_arrays) {
+      return reject("is corrupted");
+    }
+    for (uint64_t i = 0; i < m_header.array_count; ++i) {
+      const auto &entry = m_header.arrays[i];
+      if (entry.offset > m_file.size() ||
+          entry.size > m_file.size() - entry.offset ||
+          checksum64(m_file.data() + entry.offset, entry.size) !=
+              entry.checksum) {
+        return reject("is corrupted");
+      }
+    }
+    return true;
+  }
+
+  size_t array_count() const { return m_header.array_count; }
+
+  ///
+  /// \brief Get array stored in index
+  /// \param i Index of array, in order of index_writer::add calls
+  /// \return Array borrowing memory of the mapping
+  ///
+  template <typename T>
+  index_array<T> array(size_t i) const {
+    enforce(i < m_header.array_count, "Missing index array");
+    const auto &entry = m_header.arrays[i];
+    enforce(entry.size % sizeof(T) == 0, "Index has wrong size");
+    return index_array<T>::borrow(
+        reinterpret_cast<const T *>(m_file.data() + entry.offset),
+        entry.size / sizeof(T));
+  }
+
+ private:
+  bool reject(const char *reason) {
+    std::cerr << "Index file " << reason << ", rebuilding it" << std::endl;
+    m_file.close();
+    return false;
+  }
+
+  mapped_file m_file;
+  index_header m_header;
+};
+
+#endif  // INDEX_FILE_HPP
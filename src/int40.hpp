@@ -0,0 +1,106 @@
+/*-
+ * Copyright 2016 Jakub Nyckowski
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef INT40_HPP
+#define INT40_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+///
+/// \brief Signed 40-bit integer packed in 5 bytes
+///
+/// Element of suffix array and LCP arrays of files too big for int32_t.
+/// Arrays take 5 bytes per position instead of 8 and still cover files up
+/// to 512GB. Values are unpacked to int64_t for any arithmetic, only
+/// stored elements are packed.
+///
+struct int40_t {
+  int40_t() = default;
+
+  int40_t(int64_t value) {
+    const uint32_t low = static_cast<uint32_t>(value);
+    std::memcpy(m_bytes, &low, sizeof(low));
+    m_bytes[4] = static_cast<uint8_t>(value >> 32);
+  }
+
+  operator int64_t() const {
+    uint32_t low;
+    std::memcpy(&low, m_bytes, sizeof(low));
+    return static_cast<int64_t>(static_cast<int8_t>(m_bytes[4])) *
+               (int64_t(1) << 32) +
+           low;
+  }
+
+  uint8_t m_bytes[5];
+};
+
+static_assert(sizeof(int40_t) == 5 && alignof(int40_t) == 1,
+              "int40_t has to be packed");
+static_assert(std::is_trivially_copyable<int40_t>::value,
+              "int40_t arrays are read from index file");
+
+/// Largest value of int40_t
+constexpr int64_t int40_max = (int64_t(1) << 39) - 1;
+
+///
+/// \brief Type used for arithmetic on elements of index type T
+///
+template <typename T>
+struct index_value {
+  using type = T;
+};
+
+template <>
+struct index_value<int40_t> {
+  using type = int64_t;
+};
+
+template <typename T>
+using index_value_t = typename index_value<T>::type;
+
+///
+/// \brief Pack int64_t values into int40_t in the same memory
+/// Element i is written over bytes of elements up to i, which are already
+/// read. Both are copied through local values, memory is never read as
+/// other type than it holds.
+/// \param data  Memory holding count int64_t values on input
+/// \param count Number of values
+///
+inline void pack_int40(void *data, size_t count) {
+  uint8_t *bytes = static_cast<uint8_t *>(data);
+  for (size_t i = 0; i < count; ++i) {
+    int64_t wide;
+    std::memcpy(&wide, bytes + i * sizeof(int64_t), sizeof(wide));
+    const int40_t value(wide);
+    std::memcpy(bytes + i * sizeof(int40_t), &value, sizeof(value));
+  }
+}
+
+#endif  // INT40_HPP
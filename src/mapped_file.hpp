@@ -0,0 +1,189 @@
+/*-
+ * Copyright 2016 Jakub Nyckowski
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include "enforce.hpp"
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+///
+/// \brief Read-only view of contiguous bytes
+///
+/// View does not own the data, the owner has to outlive it.
+///
+class data_view {
+ public:
+  data_view() : m_data(nullptr), m_size(0) {}
+
+  data_view(const uint8_t* data, size_t size) : m_data(data), m_size(size) {}
+
+  data_view(const std::vector<uint8_t>& data)
+      : m_data(data.data()), m_size(data.size()) {}
+
+  const uint8_t* data() const { return m_data; }
+
+  size_t size() const { return m_size; }
+
+  bool empty() const { return m_size == 0; }
+
+  const uint8_t& operator[](size_t pos) const { return m_data[pos]; }
+
+  const uint8_t* begin() const { return m_data; }
+
+  const uint8_t* end() const { return m_data + m_size; }
+
+ private:
+  const uint8_t* m_data;  ///< Beginning of data
+  size_t m_size;          ///< Size of data
+};
+
+///
+/// \brief Whole file mapped read-only into memory
+///
+/// Files which cannot be mapped (pipes, character devices) are read into
+/// an internal buffer instead, so the caller always gets a data_view.
+///
+class mapped_file {
+ public:
+  mapped_file() : m_mapping(nullptr), m_size(0) {}
+
+  explicit mapped_file(const std::string& file_path) : mapped_file() {
+    open(file_path);
+  }
+
+  mapped_file(const mapped_file&) = delete;
+  mapped_file& operator=(const mapped_file&) = delete;
+
+  mapped_file(mapped_file&& mf) noexcept : m_mapping(mf.m_mapping),
+                                           m_size(mf.m_size),
+                                           m_buffer(std::move(mf.m_buffer)) {
+    mf.m_mapping = nullptr;
+    mf.m_size = 0;
+  }
+
+  ~mapped_file() { close(); }
+
+  ///
+  /// \brief Map file, read it into buffer if it cannot be mapped
+  /// \param file_path Path to file
+  ///
+  void open(const std::string& file_path) {
+    if (try_map(file_path)) return;
+
+    int fd = ::open(file_path.c_str(), O_RDONLY);
+    enforce(fd >= 0, "Cannot open file");
+    read_all(fd);
+    ::close(fd);
+  }
+
+  ///
+  /// \brief Map file without falling back to buffer
+  /// \param file_path Path to file
+  /// \return true if whole file is available through view()
+  ///
+  bool try_map(const std::string& file_path) {
+    close();
+    int fd = ::open(file_path.c_str(), O_RDONLY);
+    enforce(fd >= 0, "Cannot open file");
+
+    struct stat st;
+    enforce(::fstat(fd, &st) == 0, "Cannot stat file");
+
+    // Empty file cannot be mapped, but empty view describes it correctly
+    bool mapped = S_ISREG(st.st_mode) && st.st_size == 0;
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+      void* mapping = ::mmap(nullptr, static_cast<size_t>(st.st_size),
+                             PROT_READ, MAP_PRIVATE, fd, 0);
+      if (mapping != MAP_FAILED) {
+        m_mapping = static_cast<const uint8_t*>(mapping);
+        m_size = static_cast<size_t>(st.st_size);
+        mapped = true;
+      }
+    }
+
+    ::close(fd);
+    return mapped;
+  }
+
+  ///
+  /// \brief Give kernel a hint how the data will be accessed
+  /// \param advice One of MADV_* values
+  ///
+  void advise(int advice) const {
+    if (m_mapping) {
+      // Only a hint, failure is not an error
+      ::madvise(const_cast<uint8_t*>(m_mapping), m_size, advice);
+    }
+  }
+
+  data_view view() const {
+    return m_mapping ? data_view(m_mapping, m_size) : data_view(m_buffer);
+  }
+
+  const uint8_t* data() const { return view().data(); }
+
+  size_t size() const { return view().size(); }
+
+  void close() {
+    if (m_mapping) {
+      ::munmap(const_cast<uint8_t*>(m_mapping), m_size);
+      m_mapping = nullptr;
+      m_size = 0;
+    }
+    m_buffer.clear();
+    m_buffer.shrink_to_fit();
+  }
+
+ private:
+  void read_all(int fd) {
+    const size_t step = 1024 * 1024;
+    size_t size = 0;
+    for (;;) {
+      m_buffer.resize(size + step);
+      ssize_t chunk = ::read(fd, m_buffer.data() + size, step);
+      enforce(chunk >= 0, "Read error");
+      if (chunk == 0) break;
+      size += static_cast<size_t>(chunk);
+    }
+    m_buffer.resize(size);
+  }
+
+  const uint8_t* m_mapping;       ///< Mapped file or nullptr
+  size_t m_size;                  ///< Size of mapping
+  std::vector<uint8_t> m_buffer;  ///< Data of not mappable file
+};
+
+#endif  // MAPPED_FILE_HPP
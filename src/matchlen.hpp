@@ -29,17 +29,18 @@
 #ifndef MATCHLEN_HPP
 #define MATCHLEN_HPP
 
+#include "simd.hpp"
+
+#include <algorithm>
 #include <cstdint>
 
 template <typename T>
 static T matchlen(const uint8_t *source, T source_size, const uint8_t *target,
                   T target_size) {
-  T i;
-
-  for (i = 0; (i < source_size) && (i < target_size); i++)
-    if (source[i] != target[i]) break;
-
-  return i;
+  T size = std::min(source_size, target_size);
+  if (size <= 0) return 0;
+  return static_cast<T>(
+      find_mismatch(source, target, static_cast<size_t>(size)));
 }
 
 #endif  // MATCHLEN_HPP
@@ -0,0 +1,96 @@
+/*-
+ * Copyright 2016 Jakub Nyckowski
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef MEMORY_BUDGET_HPP
+#define MEMORY_BUDGET_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+
+///
+/// \brief Limit of memory shared by many buffers
+///
+/// Buffers acquire memory before they allocate it and release it when they
+/// free it. A buffer which must make progress to avoid a deadlock can pass
+/// an urgent flag, it is allowed to go over the limit while the flag is set.
+///
+class memory_budget {
+ public:
+  ///
+  /// \brief Create budget
+  /// \param limit Limit in bytes
+  ///
+  explicit memory_budget(size_t limit) : m_limit(limit), m_used(0) {}
+
+  memory_budget(const memory_budget &) = delete;
+  memory_budget &operator=(const memory_budget &) = delete;
+
+  ///
+  /// \brief Wait until memory is available
+  /// \param bytes  Number of bytes to acquire
+  /// \param urgent When set, memory is granted immediately
+  ///
+  void acquire(size_t bytes, const std::atomic_bool &urgent) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_available.wait(lock, [&]() {
+      return m_used + bytes <= m_limit || urgent.load();
+    });
+    m_used += bytes;
+  }
+
+  ///
+  /// \brief Give memory back
+  /// \param bytes Number of bytes acquired earlier
+  ///
+  void release(size_t bytes) {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_used -= bytes;
+    }
+    m_available.notify_all();
+  }
+
+  ///
+  /// \brief Wake waiting threads after an urgent flag has been set
+  ///
+  void notify() {
+    // Lock orders the flag store before waiters check it
+    { std::lock_guard<std::mutex> lock(m_mutex); }
+    m_available.notify_all();
+  }
+
+  size_t limit() const { return m_limit; }
+
+ private:
+  const size_t m_limit;  ///< Limit in bytes
+  size_t m_used;         ///< Acquired bytes, guarded by m_mutex
+  std::mutex m_mutex;
+  std::condition_variable m_available;
+};
+
+#endif  // MEMORY_BUDGET_HPP
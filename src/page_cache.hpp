@@ -0,0 +1,174 @@
+/*-
+ * Copyright 2016 Jakub Nyckowski
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef PAGE_CACHE_HPP
+#define PAGE_CACHE_HPP
+
+#include "enforce.hpp"
+#include "external_sort.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+///
+/// \brief Pages of a file cached in memory of fixed size
+///
+/// Pool of page frames is split into shards by page number, each with its
+/// own lock, so threads reading different pages rarely wait for each
+/// other. Frames are reused in CLOCK order: a page read since the hand
+/// passed it gets a second chance. Top rows of a binary search are read by
+/// every search, so they stay in memory and only the last steps of a
+/// search go to disk.
+///
+class page_cache {
+ public:
+  ///
+  /// \param file      Cached file, it has to outlive the cache
+  /// \param page_size Size of page in bytes
+  /// \param memory    Memory of all frames in bytes
+  ///
+  page_cache(const temp_file &file, size_t page_size, size_t memory)
+      : m_file(file), m_page_size(page_size) {
+    const size_t frames =
+        std::max(memory / page_size, static_cast<size_t>(shards_number));
+    for (size_t i = 0; i < shards_number; ++i) {
+      m_shards.emplace_back(new shard);
+      const size_t shard_frames =
+          frames / shards_number + (i < frames % shards_number ? 1 : 0);
+      m_shards.back()->frames.resize(shard_frames);
+      m_shards.back()->data.resize(shard_frames * page_size);
+    }
+  }
+
+  ///
+  /// \brief Copy bytes of one page, can be called by many threads
+  /// \param offset Position in file
+  /// \param data   Output
+  /// \param size   Number of bytes, they cannot cross end of page
+  ///
+  void read(uint64_t offset, void *data, size_t size) const {
+    const uint64_t page = offset / m_page_size;
+    shard &s = *m_shards[page % shards_number];
+    std::lock_guard<std::mutex> lock(s.lock);
+    const size_t frame = find(s, page);
+    std::memcpy(data,
+                s.data.data() + frame * m_page_size + offset % m_page_size,
+                size);
+  }
+
+ private:
+  static constexpr size_t shards_number = 16;
+
+  struct frame {
+    uint64_t page = 0;
+    bool used = false;        ///< Frame holds a page
+    bool referenced = false;  ///< Read since the hand passed it
+  };
+
+  struct shard {
+    std::mutex lock;
+    std::unordered_map<uint64_t, size_t> frames_of_pages;
+    std::vector<frame> frames;
+    std::vector<uint8_t> data;  ///< Pages of all frames
+    size_t hand = 0;            ///< Next candidate to be replaced
+  };
+
+  /// Frame of page, reads the page when it is missing
+  size_t find(shard &s, uint64_t page) const {
+    auto it = s.frames_of_pages.find(page);
+    if (it != s.frames_of_pages.end()) {
+      s.frames[it->second].referenced = true;
+      return it->second;
+    }
+
+    while (s.frames[s.hand].referenced) {
+      s.frames[s.hand].referenced = false;
+      s.hand = (s.hand + 1) % s.frames.size();
+    }
+    const size_t victim = s.hand;
+    s.hand = (s.hand + 1) % s.frames.size();
+    frame &f = s.frames[victim];
+    if (f.used) s.frames_of_pages.erase(f.page);
+
+    const uint64_t offset = page * m_page_size;
+    const size_t size = static_cast<size_t>(
+        std::min<uint64_t>(m_page_size, m_file.size() - offset));
+    m_file.read(offset, s.data.data() + victim * m_page_size, size);
+    f.page = page;
+    f.used = true;
+    f.referenced = true;
+    s.frames_of_pages[page] = victim;
+    return victim;
+  }
+
+  const temp_file &m_file;
+  const size_t m_page_size;
+  std::vector<std::unique_ptr<shard>> m_shards;
+};
+
+///
+/// \brief Read-only array of index type stored in file, read through cache
+///
+/// Drop-in for index_array in search functions: operator[] returns element
+/// by value.
+///
+template <typename I>
+class paged_array {
+ public:
+  /// Elements in one page, pages never split an element
+  static constexpr size_t page_elements = 4096;
+
+  ///
+  /// \param file   File of elements, it has to outlive the array
+  /// \param memory Memory of page cache in bytes
+  ///
+  paged_array(const temp_file &file, size_t memory)
+      : m_cache(file, page_elements * sizeof(I), memory),
+        m_size(static_cast<size_t>(file.size() / sizeof(I))) {}
+
+  size_t size() const { return m_size; }
+
+  I operator[](size_t pos) const {
+    I value;
+    m_cache.read(pos * sizeof(I), &value, sizeof(I));
+    return value;
+  }
+
+  /// Pages are read only when needed
+  void prefetch(size_t) const {}
+
+ private:
+  page_cache m_cache;
+  size_t m_size;
+};
+
+#endif  // PAGE_CACHE_HPP
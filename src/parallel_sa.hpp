@@ -0,0 +1,345 @@
+/*-
+ * Copyright 2016 Jakub Nyckowski
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef PARALLEL_SA_HPP
+#define PARALLEL_SA_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+///
+/// \brief Run f(thread) on threads_number threads, the caller is thread 0
+///
+template <typename F>
+void run_parallel(uint32_t threads_number, F f) {
+  std::vector<std::thread> threads;
+  for (uint32_t t = 1; t < threads_number; ++t) threads.emplace_back(f, t);
+  f(0);
+  for (auto &t : threads) t.join();
+}
+
+///
+/// \brief Parallel suffix array construction by prefix doubling
+///
+/// Suffixes are bucket sorted by the first two bytes, then every round
+/// sorts groups of suffixes with equal prefix of h bytes by rank of the
+/// suffix h bytes further, which doubles sorted prefix (Larsson-Sadakane).
+/// Groups are sorted by many threads and large groups are split between
+/// them, so unlike divsufsort it does not depend on OpenMP. Besides suffix
+/// array it needs rank array and one byte per suffix. Rounds are
+/// logarithmic in the longest repeat, so long runs make it slow.
+///
+template <typename T>
+class parallel_sa_builder {
+ public:
+  ///
+  /// \param str            Text
+  /// \param SA             Output suffix array of size elements
+  /// \param size           Size of text
+  /// \param threads_number Number of threads
+  ///
+  parallel_sa_builder(const uint8_t *str, T *SA, T size,
+                      uint32_t threads_number)
+      : m_str(str),
+        m_sa(SA),
+        m_size(size),
+        m_threads(std::max<uint32_t>(threads_number, 1)) {}
+
+  ///
+  /// \brief Build suffix array
+  ///
+  void build();
+
+ private:
+  /// Rows of suffixes with equal sorted prefix
+  struct group {
+    T begin;
+    T end;
+  };
+
+  /// Part of a group processed by one thread
+  struct piece {
+    T begin;
+    T end;
+    T group_begin;
+    T group_end;
+    T first_flag;  ///< First boundary in piece, end when there is none
+    T last_flag;   ///< Last boundary in piece, -1 when there is none
+    T start;       ///< Start of subgroup of the first row
+    T next;        ///< Next boundary after the last one in piece
+  };
+
+  /// Groups smaller than this are processed by one thread
+  static const T min_piece = 1 << 16;
+
+  /// Rank of suffix depth bytes after pos, -1 past the end
+  T rank_at(T pos, T depth) const {
+    return depth < m_size - pos ? m_rank[pos + depth] : -1;
+  }
+
+  /// Rows [begin, end) of text divided between threads
+  std::pair<T, T> chunk(uint32_t thread) const {
+    int64_t size = (m_size + int64_t(m_threads) - 1) / m_threads;
+    return {static_cast<T>(std::min<int64_t>(m_size, size * thread)),
+            static_cast<T>(std::min<int64_t>(m_size, size * (thread + 1)))};
+  }
+
+  /// Call f(piece, thread) for every piece on all threads
+  void for_pieces(std::vector<piece> &pieces,
+                  const std::function<void(piece &, uint32_t)> &f) const;
+
+  void bucket_sort();
+  void sort_groups(T depth);
+  void sort_range(T *first, T *last, T depth, uint32_t threads) const;
+  void split_groups(T depth);
+
+  const uint8_t *m_str;
+  T *m_sa;
+  const T m_size;
+  const uint32_t m_threads;
+  std::vector<T> m_rank;       ///< Row of group start of every suffix
+  std::vector<uint8_t> m_flags;  ///< Rows starting a new subgroup
+  std::vector<group> m_groups;   ///< Groups which are not sorted yet
+};
+
+template <typename T>
+const T parallel_sa_builder<T>::min_piece;
+
+template <typename T>
+void parallel_sa_builder<T>::build() {
+  if (m_size == 0) return;
+  m_rank.resize(static_cast<size_t>(m_size));
+  bucket_sort();
+  m_flags.resize(static_cast<size_t>(m_size));
+  T depth = 2;
+  while (!m_groups.empty()) {
+    sort_groups(depth);
+    split_groups(depth);
+    // Groups are empty once sorted prefix reaches size
+    depth = std::min<T>(depth, m_size / 2) * 2;
+  }
+}
+
+template <typename T>
+void parallel_sa_builder<T>::for_pieces(
+    std::vector<piece> &pieces,
+    const std::function<void(piece &, uint32_t)> &f) const {
+  std::atomic<size_t> next(0);
+  run_parallel(m_threads, [&](uint32_t t) {
+    for (size_t i = next++; i < pieces.size(); i = next++) f(pieces[i], t);
+  });
+}
+
+template <typename T>
+void parallel_sa_builder<T>::bucket_sort() {
+  // Byte + 1 and 0 past the end, so shorter suffix sorts first
+  static const size_t buckets = 257 * 257;
+  auto key = [this](T i) -> size_t {
+    return (m_str[i] + 1u) * 257 + (i + 1 < m_size ? m_str[i + 1] + 1u : 0);
+  };
+  std::vector<std::vector<T>> offsets(m_threads, std::vector<T>(buckets));
+  run_parallel(m_threads, [&](uint32_t t) {
+    std::pair<T, T> rows = chunk(t);
+    for (T i = rows.first; i < rows.second; ++i) ++offsets[t][key(i)];
+  });
+
+  std::vector<T> starts(buckets + 1);
+  T row = 0;
+  for (size_t k = 0; k < buckets; ++k) {
+    starts[k] = row;
+    for (uint32_t t = 0; t < m_threads; ++t) {
+      T count = offsets[t][k];
+      offsets[t][k] = row;
+      row += count;
+    }
+  }
+  starts[buckets] = m_size;
+
+  run_parallel(m_threads, [&](uint32_t t) {
+    std::pair<T, T> rows = chunk(t);
+    for (T i = rows.first; i < rows.second; ++i) {
+      size_t k = key(i);
+      m_sa[offsets[t][k]++] = i;
+      m_rank[i] = starts[k];
+    }
+  });
+
+  for (size_t k = 0; k < buckets; ++k) {
+    if (starts[k + 1] - starts[k] > 1) {
+      m_groups.push_back({starts[k], starts[k + 1]});
+    }
+  }
+}
+
+template <typename T>
+void parallel_sa_builder<T>::sort_range(T *first, T *last, T depth,
+                                        uint32_t threads) const {
+  auto key = [this, depth](T pos) { return rank_at(pos, depth); };
+  while (last - first > 16) {
+    T a = key(first[0]);
+    T b = key(first[(last - first) / 2]);
+    T c = key(last[-1]);
+    T pivot = std::max(std::min(a, b), std::min(std::max(a, b), c));
+
+    // Three-way partition, equal keys are done
+    T *lt = first;
+    T *gt = last;
+    for (T *i = first; i < gt;) {
+      T k = key(*i);
+      if (k < pivot) {
+        std::swap(*lt++, *i++);
+      } else if (k > pivot) {
+        std::swap(*i, *--gt);
+      } else {
+        ++i;
+      }
+    }
+
+    if (threads > 1) {
+      std::thread left(
+          [=] { sort_range(first, lt, depth, threads / 2); });
+      sort_range(gt, last, depth, threads - threads / 2);
+      left.join();
+      return;
+    }
+    // Recursion on smaller side keeps stack logarithmic
+    if (lt - first < last - gt) {
+      sort_range(first, lt, depth, 1);
+      first = gt;
+    } else {
+      sort_range(gt, last, depth, 1);
+      last = lt;
+    }
+  }
+
+  for (T *i = first + 1; i < last; ++i) {
+    T value = *i;
+    T k = key(value);
+    T *j = i;
+    for (; j > first && key(j[-1]) > k; --j) *j = j[-1];
+    *j = value;
+  }
+}
+
+template <typename T>
+void parallel_sa_builder<T>::sort_groups(T depth) {
+  std::vector<group> small;
+  for (const group &g : m_groups) {
+    if (g.end - g.begin >= min_piece && m_threads > 1) {
+      sort_range(m_sa + g.begin, m_sa + g.end, depth, m_threads);
+    } else {
+      small.push_back(g);
+    }
+  }
+
+  std::atomic<size_t> next(0);
+  run_parallel(m_threads, [&](uint32_t) {
+    static const size_t batch = 64;
+    for (size_t i = next.fetch_add(batch); i < small.size();
+         i = next.fetch_add(batch)) {
+      for (size_t j = i; j < std::min(i + batch, small.size()); ++j) {
+        sort_range(m_sa + small[j].begin, m_sa + small[j].end, depth, 1);
+      }
+    }
+  });
+}
+
+template <typename T>
+void parallel_sa_builder<T>::split_groups(T depth) {
+  std::vector<piece> pieces;
+  for (const group &g : m_groups) {
+    for (T begin = g.begin; begin < g.end; begin += min_piece) {
+      T end = std::min<T>(begin + min_piece, g.end);
+      pieces.push_back({begin, end, g.begin, g.end, end, -1, 0, 0});
+    }
+  }
+
+  // Boundaries are marked before any rank changes
+  for_pieces(pieces, [&](piece &p, uint32_t) {
+    for (T row = p.begin; row < p.end; ++row) {
+      bool boundary = row == p.group_begin ||
+                      rank_at(m_sa[row], depth) !=
+                          rank_at(m_sa[row - 1], depth);
+      m_flags[row] = boundary;
+      if (boundary) {
+        p.first_flag = std::min(p.first_flag, row);
+        p.last_flag = row;
+      }
+    }
+  });
+
+  // Subgroups can span pieces of a large group
+  for (size_t i = 0; i < pieces.size(); ++i) {
+    piece &p = pieces[i];
+    if (p.begin == p.group_begin) {
+      p.start = p.begin;
+    } else {
+      const piece &prev = pieces[i - 1];
+      p.start = prev.last_flag >= 0 ? prev.last_flag : prev.start;
+    }
+  }
+  for (size_t i = pieces.size(); i-- > 0;) {
+    piece &p = pieces[i];
+    if (p.end == p.group_end) {
+      p.next = p.group_end;
+    } else {
+      const piece &next_piece = pieces[i + 1];
+      p.next = next_piece.first_flag < next_piece.end ? next_piece.first_flag
+                                                      : next_piece.next;
+    }
+  }
+
+  std::vector<std::vector<group>> found(m_threads);
+  for_pieces(pieces, [&](piece &p, uint32_t t) {
+    T start = p.start;
+    for (T row = p.begin; row < p.end; ++row) {
+      if (m_flags[row]) {
+        // Subgroup which began in previous piece is added there
+        if (start >= p.begin && row - start > 1) {
+          found[t].push_back({start, row});
+        }
+        start = row;
+      }
+      m_rank[m_sa[row]] = start;
+    }
+    if (start >= p.begin && p.next - start > 1) {
+      found[t].push_back({start, p.next});
+    }
+  });
+
+  m_groups.clear();
+  for (const auto &groups : found) {
+    m_groups.insert(m_groups.end(), groups.begin(), groups.end());
+  }
+}
+
+#endif  // PARALLEL_SA_HPP
@@ -0,0 +1,186 @@
+/*-
+ * Copyright 2016 Jakub Nyckowski
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef PATCH_INDEX_HPP
+#define PATCH_INDEX_HPP
+
+#include "andiff_private.hpp"
+#include "enforce.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+///
+/// \brief Place in patch where applying can start
+///
+/// Seek point is the beginning of a control record. It keeps all cursors
+/// which sequential applying would have at this record.
+///
+struct seek_point {
+  int64_t new_pos;  ///< Position in new file
+  int64_t old_pos;  ///< Position in old file
+  /// Position in uncompressed sections, indexed by patch_section
+  std::array<int64_t, 3> section_pos;
+};
+
+///
+/// \brief Index stored at the end of andiff_magic patch
+///
+/// Seek points are added at least every andiff_seek_interval bytes of new
+/// file. Offsets of compressed chunks make any position in a section
+/// reachable without decompressing previous chunks, because every chunk
+/// except the last one holds andiff_chunk_size bytes.
+///
+class patch_index {
+ public:
+  ///
+  /// \brief Add seek point, points have to be added in new file order
+  /// \param point Seek point
+  ///
+  void add_point(const seek_point &point) { m_points.push_back(point); }
+
+  ///
+  /// \brief Check if seek point should be added at given position
+  /// \param new_pos Position in new file of next control record
+  ///
+  bool needs_point(int64_t new_pos) const {
+    return m_points.empty() ||
+           new_pos - m_points.back().new_pos >= andiff_seek_interval;
+  }
+
+  ///
+  /// \brief Set offsets of compressed chunks
+  /// \param section Section of patch
+  /// \param offsets Offset of every chunk and of stream terminator,
+  ///                relative to beginning of section
+  ///
+  void set_chunk_offsets(patch_section section, std::vector<int64_t> offsets) {
+    m_chunk_offsets[section] = std::move(offsets);
+  }
+
+  ///
+  /// \brief Find last seek point not after position
+  /// \param new_pos Position in new file
+  /// \return Seek point
+  ///
+  const seek_point &find(int64_t new_pos) const {
+    enforce_throw(!m_points.empty(), "Patch index is empty");
+    auto it = std::upper_bound(
+        m_points.begin(), m_points.end(), new_pos,
+        [](int64_t pos, const seek_point &p) { return pos < p.new_pos; });
+    return it == m_points.begin() ? *it : *(it - 1);
+  }
+
+  ///
+  /// \brief Offset of compressed chunk holding position of section
+  /// \param section Section of patch
+  /// \param pos     Position in uncompressed section
+  /// \return Offset relative to beginning of section
+  ///
+  int64_t chunk_offset(patch_section section, int64_t pos) const {
+    const std::vector<int64_t> &offsets = m_chunk_offsets[section];
+    size_t chunk = static_cast<size_t>(pos / andiff_chunk_size);
+    enforce_throw(pos >= 0 && chunk < offsets.size(),
+                  "Corrupt patch, section position out of range");
+    return offsets[chunk];
+  }
+
+  const std::vector<seek_point> &points() const { return m_points; }
+
+  bool empty() const { return m_points.empty(); }
+
+  ///
+  /// \brief Encode index
+  /// Number of points, points, and for every section number of offsets
+  /// followed by offsets. All values are stored with offtout.
+  /// \return Encoded index
+  ///
+  std::vector<uint8_t> serialize() const {
+    std::vector<int64_t> values;
+    values.push_back(static_cast<int64_t>(m_points.size()));
+    for (const auto &point : m_points) {
+      values.push_back(point.new_pos);
+      values.push_back(point.old_pos);
+      values.insert(values.end(), point.section_pos.begin(),
+                    point.section_pos.end());
+    }
+    for (const auto &offsets : m_chunk_offsets) {
+      values.push_back(static_cast<int64_t>(offsets.size()));
+      values.insert(values.end(), offsets.begin(), offsets.end());
+    }
+
+    std::vector<uint8_t> buf(values.size() * 8);
+    for (size_t i = 0; i < values.size(); ++i) {
+      offtout(values[i], buf.data() + 8 * i);
+    }
+    return buf;
+  }
+
+  ///
+  /// \brief Decode index encoded by serialize
+  /// \param data Encoded index
+  /// \param size Size of encoded index
+  ///
+  void deserialize(const uint8_t *data, size_t size) {
+    size_t pos = 0;
+    auto next = [&]() {
+      enforce_throw(pos + 8 <= size, "Corrupt patch index");
+      int64_t value = offtin(data + pos);
+      pos += 8;
+      return value;
+    };
+    auto count = [&](size_t record_size) {
+      int64_t value = next();
+      enforce_throw(
+          value >= 0 &&
+              static_cast<uint64_t>(value) <= (size - pos) / record_size,
+          "Corrupt patch index");
+      return static_cast<size_t>(value);
+    };
+
+    m_points.resize(count(5 * 8));
+    for (auto &point : m_points) {
+      point.new_pos = next();
+      point.old_pos = next();
+      for (auto &section_pos : point.section_pos) section_pos = next();
+    }
+    for (auto &offsets : m_chunk_offsets) {
+      offsets.resize(count(8));
+      for (auto &offset : offsets) offset = next();
+    }
+    enforce_throw(pos == size, "Corrupt patch index");
+  }
+
+ private:
+  std::vector<seek_point> m_points;  ///< Ordered by new_pos
+  /// Chunk offsets, indexed by patch_section
+  std::array<std::vector<int64_t>, 3> m_chunk_offsets;
+};
+
+#endif  // PATCH_INDEX_HPP
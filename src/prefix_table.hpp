@@ -0,0 +1,177 @@
+/*-
+ * Copyright 2016 Jakub Nyckowski
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef PREFIX_TABLE_HPP
+#define PREFIX_TABLE_HPP
+
+#include "andiff_private.hpp"
+#include "enforce.hpp"
+#include "index_array.hpp"
+#include "index_file.hpp"
+#include "int40.hpp"
+#include "mapped_file.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+///
+/// \brief State of binary search of search_simple
+///
+template <typename T>
+struct simple_range {
+  T lpos;  ///< Row before the range of rows to search
+  T rpos;  ///< Last row of the range
+  T lmin;  ///< Bytes common to target and row lpos
+  T rmin;  ///< Bytes common to target and row rpos
+};
+
+///
+/// \brief First row of suffix array of every k-byte prefix
+///
+/// Search of a target starts in the bucket of its first k bytes instead
+/// of the whole suffix array, and these bytes are known to match.
+///
+template <typename I>
+class prefix_table {
+ public:
+  using value_type = index_value_t<I>;
+
+  ///
+  /// \brief Set number of bytes of prefix, before build()
+  /// \param bytes From 1 up to andiff_max_prefix_bytes
+  ///
+  void set_bytes(uint32_t bytes);
+
+  ///
+  /// \brief Fill table from suffix array
+  /// \param SA     Suffix array with size() rows, read in order
+  /// \param source Text of suffix array
+  ///
+  template <typename array>
+  void build(const array &SA, data_view source);
+
+  void save(index_writer &writer) const;
+
+  ///
+  /// \brief Use table stored in index, number of bytes follows its size
+  /// \param reader Index
+  /// \param i      Index of array
+  ///
+  void load(const index_reader &reader, size_t i);
+
+  ///
+  /// \brief Range of search_simple from bucket of data
+  /// \param data        Target
+  /// \param size        Size of target
+  /// \param source_size Size of text of suffix array
+  ///
+  inline simple_range<value_type> bucket(const uint8_t *data,
+                                         value_type size,
+                                         value_type source_size) const;
+
+  /// Memory of table with given number of bytes
+  static size_t memory(uint32_t bytes) {
+    return ((size_t(1) << (8 * bytes)) + 1) * sizeof(I);
+  }
+
+ private:
+  /// Bucket of first m_bytes bytes, shorter data is padded with 0
+  inline size_t key(const uint8_t *data, size_t size) const;
+
+  uint32_t m_bytes = andiff_default_prefix_bytes;
+  /// First row of suffix array of every bucket, then size of suffix array
+  index_array<I> m_table;
+};
+
+template <typename I>
+void prefix_table<I>::set_bytes(uint32_t bytes) {
+  enforce(bytes >= 1 && bytes <= andiff_max_prefix_bytes,
+          "Prefix table has from 1 to 3 bytes");
+  m_bytes = bytes;
+}
+
+template <typename I>
+size_t prefix_table<I>::key(const uint8_t *data, size_t size) const {
+  size_t key = 0;
+  for (uint32_t i = 0; i < m_bytes; ++i) {
+    key = (key << 8) | (i < size ? data[i] : 0);
+  }
+  return key;
+}
+
+template <typename I>
+template <typename array>
+void prefix_table<I>::build(const array &SA, data_view source) {
+  // Keys of rows never decrease, because padding sorts before any byte,
+  // so one pass fills start of every bucket
+  const size_t buckets = size_t(1) << (8 * m_bytes);
+  std::vector<I> table(buckets + 1);
+  size_t next_key = 0;
+  for (size_t row = 0; row < SA.size(); ++row) {
+    const size_t pos = static_cast<size_t>(SA[row]);
+    const size_t row_key = key(source.data() + pos, source.size() - pos);
+    while (next_key <= row_key) {
+      table[next_key++] = static_cast<value_type>(row);
+    }
+  }
+  while (next_key <= buckets) {
+    table[next_key++] = static_cast<value_type>(SA.size());
+  }
+  m_table = index_array<I>(std::move(table));
+}
+
+template <typename I>
+void prefix_table<I>::save(index_writer &writer) const {
+  writer.add(m_table.data(), m_table.size());
+}
+
+template <typename I>
+void prefix_table<I>::load(const index_reader &reader, size_t i) {
+  m_table = reader.template array<I>(i);
+  for (m_bytes = 1; m_bytes <= andiff_max_prefix_bytes; ++m_bytes) {
+    if (m_table.size() == (size_t(1) << (8 * m_bytes)) + 1) return;
+  }
+  throw std::runtime_error("Index has wrong size");
+}
+
+template <typename I>
+simple_range<typename prefix_table<I>::value_type> prefix_table<I>::bucket(
+    const uint8_t *data, value_type size, value_type source_size) const {
+  // Rows of the bucket share known bytes with target, search starts
+  // between rows around the bucket
+  const value_type known = std::min(static_cast<value_type>(m_bytes), size);
+  const size_t width = size_t(1) << (8 * (m_bytes - known));
+  const size_t first_key = key(data, static_cast<size_t>(size));
+  const value_type first = m_table[first_key];
+  const value_type last = m_table[first_key + width];
+  return {first ? first - 1 : first, std::min(last, source_size), known,
+          known};
+}
+
+#endif  // PREFIX_TABLE_HPP
@@ -27,9 +27,18 @@
 #ifndef READERS_HPP
 #define READERS_HPP
 
+#include "andiff_private.hpp"
+#include "codecs.hpp"
 #include "enforce.hpp"
+#include "patch_index.hpp"
+#include "thread_pool.hpp"
 
 #include <algorithm>
+#include <array>
+#include <cstdio>
+#include <deque>
+#include <future>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -38,45 +47,42 @@
 
 #include <bzlib.h>
 
-#if 0
-/// Unused interface
-class base_data_reader {
- public:
-  virtual void open(const std::string& file_path) = 0;
-
-  virtual ssize_t read(std::uint8_t * buf, ssize_t size) = 0;
-
-  virtual bool eof() = 0;
-
-  virtual ssize_t seek(ssize_t pos) = 0;
-
-  virtual void close() = 0;
-};
-#endif
-
 class file_reader {
  public:
   file_reader() : m_fd(-1), m_curr_pos(0), m_size(0) {}
 
   void open(const std::string& file_path) {
     m_fd = ::open(file_path.c_str(), O_RDONLY);
-    enforce(m_fd > 0, "Cannot open file");
+    enforce_throw(m_fd > 0, "Cannot open file");
     m_size = get_file_size();
   }
 
   ssize_t size() { return m_size; }
 
+  ///
+  /// \brief Read data, less than requested only at the end of file
+  /// \param buf  Output buffer
+  /// \param size Number of bytes to read
+  /// \return Number of read bytes
+  ///
   template <typename Type>
   ssize_t read(Type* buf, ssize_t size) {
-    ssize_t chunk = ::read(m_fd, buf, size);
-    enforce(chunk > 0, "Read 0 bytes");
-    m_curr_pos += chunk;
-    return static_cast<ssize_t>(chunk);
+    uint8_t* out = reinterpret_cast<uint8_t*>(buf);
+    ssize_t done = 0;
+    while (done < size) {
+      ssize_t chunk = ::read(m_fd, out + done, size - done);
+      enforce_throw(chunk >= 0, "Read error");
+      if (chunk == 0) break;
+      done += chunk;
+    }
+    enforce_throw(done > 0, "Read 0 bytes");
+    m_curr_pos += done;
+    return done;
   }
 
   ssize_t seek(ssize_t pos) {
     ssize_t ret = ::lseek(m_fd, pos, SEEK_SET);
-    enforce(ret == pos, "lseek error");
+    enforce_throw(ret == pos, "lseek error");
     m_curr_pos = ret;
     return ret;
   }
@@ -86,10 +92,10 @@ class file_reader {
  private:
   ssize_t get_file_size() {
     ssize_t seek_ret = lseek(m_fd, 0, SEEK_END);
-    enforce(seek_ret != -1, "lseek error");
+    enforce_throw(seek_ret != -1, "lseek error");
     ssize_t file_size = seek_ret;
     ssize_t seek_ret_again = lseek(m_fd, 0, SEEK_SET);
-    enforce(seek_ret_again == 0, "");
+    enforce_throw(seek_ret_again == 0, "");
     return file_size;
   }
 
@@ -98,78 +104,360 @@ class file_reader {
   ssize_t m_size;
 };
 
-class anpatch_reader {
+///
+/// \brief Sequential stream of decompressed patch data
+///
+class patch_stream {
  public:
-  anpatch_reader() : m_eof(false) {}
+  virtual ~patch_stream() = default;
+
+  ///
+  /// \brief Read data from stream
+  /// \param buf  Output buffer
+  /// \param size Number of bytes to read
+  /// \return Number of read bytes, less than size only at the end of stream
+  ///
+  virtual ssize_t read(uint8_t* buf, ssize_t size) = 0;
+
+  ///
+  /// \brief Check if whole stream has been read
+  /// \return true if there is no more data
+  ///
+  virtual bool eof() const = 0;
+};
 
-  template <size_t N>
-  anpatch_reader(const std::string& file_path, const char (&magic)[N])
+///
+/// \brief Reader of single bzip2 stream (andiff_magic_bz2_stream format)
+///
+class bz2_stream_reader : public patch_stream {
+ public:
+  bz2_stream_reader(const std::string& file_path, int64_t offset)
       : m_eof(false) {
-    open(file_path, magic);
-  }
-
-  anpatch_reader(anpatch_reader&& an_reader) noexcept = default;
-
-  template <size_t N>
-  void open(const std::string& file_path, const char (&magic)[N]) {
     m_fd = std::fopen(file_path.c_str(), "r");
-    enforce(m_fd, "Cannot open bz2 file");
-
-    check_magic(magic);
+    enforce_throw(m_fd, "Cannot open patch file");
+    enforce_throw(std::fseek(m_fd, offset, SEEK_SET) == 0, "bad seek");
 
     int bz2err;
     m_bz2file = BZ2_bzReadOpen(&bz2err, m_fd, 0, 0, NULL, 0);
-    enforce(bz2err == BZ_OK, "bz2 read error");
+    enforce_throw(bz2err == BZ_OK, "bz2 read error");
   }
 
-  ssize_t size() {
-    ssize_t seek_ret = std::fseek(m_fd, 0, SEEK_END);
-    enforce(seek_ret != -1, "bad seek");
-    ssize_t file_size = std::ftell(m_fd);
-    std::fseek(m_fd, 0, SEEK_SET);
-    return file_size;
+  ~bz2_stream_reader() {
+    int bz2err;
+    BZ2_bzReadClose(&bz2err, m_bz2file);
+    std::fclose(m_fd);
   }
 
-  template <typename Type>
-  ssize_t read(Type* buf, ssize_t size) {
+  ssize_t read(uint8_t* buf, ssize_t size) override {
     int bz2err;
     int n = BZ2_bzRead(&bz2err, m_bz2file, buf, int(size));
     if (bz2err == BZ_STREAM_END)
       m_eof = true;
     else
-      enforce(bz2err == BZ_OK, "bz2 read error");
-    enforce(n > 0,
-            "bz2 read no data");  ///@todo What in case when eof was reached??
+      enforce_throw(bz2err == BZ_OK, "bz2 read error");
+    ///@todo What in case when eof was reached??
+    enforce_throw(n > 0, "bz2 read no data");
     return static_cast<ssize_t>(n);
   }
 
-  bool eof() { return m_eof; }
+  bool eof() const override { return m_eof; }
 
-  void close() {
-    int bz2err;
-    BZ2_bzReadClose(&bz2err, m_bz2file);
-    fclose(m_fd);
+ private:
+  FILE* m_fd;
+  BZFILE* m_bz2file;
+  bool m_eof;
+};
+
+///
+/// \brief Reader of chunk stream
+///
+/// Following chunks are decompressed ahead on the thread pool, while the
+/// current one is consumed. Reader can be limited to a part of the stream,
+/// then chunks after the limit are neither read nor decompressed.
+///
+class chunk_reader : public patch_stream {
+ public:
+  ///
+  /// \brief Constructor
+  /// \param file_path Patch location
+  /// \param offset    Position of first chunk in file
+  /// \param pool      Thread pool used for decompression
+  /// \param codec     Codec used to compress chunks
+  /// \param skip      Number of bytes to skip in first chunk
+  /// \param limit     Number of bytes to read after skip, -1 for whole stream
+  ///
+  chunk_reader(const std::string& file_path, int64_t offset, thread_pool& pool,
+               std::shared_ptr<const base_codec> codec, int64_t skip = 0,
+               int64_t limit = -1)
+      : m_pool(pool),
+        m_codec(std::move(codec)),
+        m_chunk_pos(0),
+        m_queued(-skip),
+        m_limit(limit),
+        m_last_chunk(false),
+        m_eof(false) {
+    m_fd = std::fopen(file_path.c_str(), "r");
+    enforce_throw(m_fd, "Cannot open patch file");
+    enforce_throw(std::fseek(m_fd, offset, SEEK_SET) == 0, "bad seek");
+    next_chunk();
+    if (skip > 0 && !m_eof) {
+      enforce_throw(skip <= static_cast<int64_t>(m_chunk.size()),
+                    "Corrupt patch, section position out of range");
+      m_chunk_pos = static_cast<size_t>(skip);
+      if (m_chunk_pos == m_chunk.size()) next_chunk();
+    }
+  }
+
+  ~chunk_reader() {
+    // Wait for decompression which still may use this object
+    for (auto& chunk : m_pending) chunk.wait();
+    std::fclose(m_fd);
+  }
+
+  ssize_t read(uint8_t* buf, ssize_t size) override {
+    ssize_t done = 0;
+    while (done < size && !m_eof) {
+      ssize_t n = std::min<ssize_t>(size - done, m_chunk.size() - m_chunk_pos);
+      std::copy(m_chunk.begin() + m_chunk_pos,
+                m_chunk.begin() + m_chunk_pos + n, buf + done);
+      m_chunk_pos += n;
+      done += n;
+      if (m_chunk_pos == m_chunk.size()) next_chunk();
+    }
+    enforce_throw(done > 0, "Read after end of patch");
+    return done;
   }
 
+  bool eof() const override { return m_eof; }
+
  private:
-  template <size_t N>
-  inline void check_magic(const char (&magic_string)[N]) {
-    static_assert(N > 0, "N cannot be less than 1");
-    std::vector<char> magic(N - 1);
-    size_t read = fread(magic.data(), 1, magic.size(), m_fd);
-    enforce(read == magic.size(), "");
-    enforce(std::equal(magic.begin(), magic.end(), magic_string),
-            "Wrong magic");
+  ///
+  /// \brief Read compressed chunks from file and queue them for decompression
+  ///
+  void fill() {
+    while (!m_last_chunk && m_pending.size() < 2 * m_pool.size() &&
+           (m_limit < 0 || m_queued < m_limit)) {
+      uint8_t header[andiff_chunk_header_size];
+      enforce_throw(fread(header, sizeof(header), 1, m_fd) == 1,
+                    "Truncated patch");
+      int64_t raw_size = offtin(header);
+      int64_t compressed_size = offtin(header + 8);
+      enforce_throw(raw_size >= 0 && raw_size <= andiff_chunk_size &&
+                        compressed_size >= 0,
+                    "Corrupt patch chunk");
+
+      if (raw_size == 0) {
+        m_last_chunk = true;
+        break;
+      }
+
+      m_queued += raw_size;
+      auto compressed = std::make_shared<std::vector<uint8_t>>(compressed_size);
+      enforce_throw(fread(compressed->data(), compressed_size, 1, m_fd) == 1,
+                    "Truncated patch");
+      std::shared_ptr<const base_codec> codec = m_codec;
+      m_pending.push_back(m_pool.submit([compressed, raw_size, codec]() {
+        std::vector<uint8_t> chunk(raw_size);
+        codec->decompress(compressed->data(), compressed->size(), chunk.data(),
+                          chunk.size());
+        return chunk;
+      }));
+    }
+  }
 
-    int64_t patch_size;
-    read = fread(&patch_size, 1, sizeof(int64_t), m_fd);
-    enforce(read == sizeof(int64_t), "read error");
-    enforce(patch_size >= 0, "Corrupt patch\n");
+  void next_chunk() {
+    fill();
+    m_chunk_pos = 0;
+    if (m_pending.empty()) {
+      m_chunk.clear();
+      m_eof = true;
+      return;
+    }
+    m_chunk = m_pending.front().get();
+    m_pending.pop_front();
+    fill();
   }
 
   FILE* m_fd;
-  BZFILE* m_bz2file;
+  thread_pool& m_pool;                        ///< Pool used for decompression
+  std::shared_ptr<const base_codec> m_codec;  ///< Chunk decompression
+  std::vector<uint8_t> m_chunk;  ///< Decompressed current chunk
+  size_t m_chunk_pos;            ///< Read position in current chunk
+  int64_t m_queued;              ///< Bytes after skip in queued chunks
+  int64_t m_limit;               ///< Bytes to read, -1 if not limited
+  bool m_last_chunk;             ///< Stream terminator has been read
   bool m_eof;
+  std::deque<std::future<std::vector<uint8_t>>> m_pending;  ///< In order
+};
+
+///
+/// \brief Patch reader
+///
+/// Reads both patch formats. Format andiff_magic_bz2_stream keeps control,
+/// diff and extra data interleaved in one bzip2 stream. Format andiff_magic
+/// stores them in separate sections, each compressed by its own codec and
+/// decompressed independently, and has patch_index, so its sections can be
+/// read from any position.
+///
+class anpatch_reader {
+ public:
+  anpatch_reader() = default;
+
+  anpatch_reader(const std::string& file_path, thread_pool& pool) {
+    open(file_path, pool);
+  }
+
+  anpatch_reader(anpatch_reader&& an_reader) noexcept = default;
+
+  void open(const std::string& file_path, thread_pool& pool) {
+    FILE* fd = std::fopen(file_path.c_str(), "r");
+    enforce_throw(fd, "Cannot open patch file");
+
+    constexpr size_t magic_size = sizeof(andiff_magic) - 1;
+    char magic[magic_size];
+    size_t read = fread(magic, 1, magic_size, fd);
+    enforce_throw(read == magic_size, "read error");
+
+    read = fread(&m_new_size, 1, sizeof(int64_t), fd);
+    enforce_throw(read == sizeof(int64_t), "read error");
+    enforce_throw(m_new_size >= 0, "Corrupt patch\n");
+
+    int64_t offset = magic_size + sizeof(int64_t);
+    if (std::equal(magic, magic + magic_size, andiff_magic)) {
+      std::array<uint8_t, andiff_codecs_size> codecs;
+      enforce_throw(fread(codecs.data(), codecs.size(), 1, fd) == 1,
+                    "read error");
+      offset += codecs.size();
+
+      // Sizes of sections, followed by size of index
+      std::array<uint8_t, 8 * 4> buf;
+      enforce_throw(fread(buf.data(), buf.size(), 1, fd) == 1, "read error");
+      offset += buf.size();
+      for (size_t i = 0; i < m_streams.size(); ++i) {
+        int64_t section_size = offtin(buf.data() + 8 * i);
+        enforce_throw(section_size >= 0, "Corrupt patch\n");
+        m_codecs[i] = make_codec(static_cast<codec_id>(codecs[i]));
+        m_section_offsets[i] = offset;
+        m_streams[i] = std::make_shared<chunk_reader>(file_path, offset, pool,
+                                                      m_codecs[i]);
+        offset += section_size;
+      }
+
+      int64_t index_size = offtin(buf.data() + 8 * 3);
+      enforce_throw(index_size >= 0, "Corrupt patch\n");
+      std::vector<uint8_t> index(static_cast<size_t>(index_size));
+      enforce_throw(std::fseek(fd, offset, SEEK_SET) == 0 &&
+                        fread(index.data(), index.size(), 1, fd) == 1,
+                    "Truncated patch");
+      m_index.deserialize(index.data(), index.size());
+      m_file_path = file_path;
+      m_pool = &pool;
+    } else {
+      enforce_throw(
+          std::equal(magic, magic + magic_size, andiff_magic_bz2_stream),
+          "Wrong magic");
+      m_streams.fill(std::make_shared<bz2_stream_reader>(file_path, offset));
+    }
+    std::fclose(fd);
+  }
+
+  ///
+  /// \brief Read control record
+  /// \param ctrl Output: diff size, extra size and old file seek
+  ///
+  void read_control(int64_t (&ctrl)[3]) {
+    uint8_t buf[8 * 3];
+    enforce_throw(read_all(section_control, buf, sizeof(buf)) == sizeof(buf),
+                  "Corrupt patch");
+    for (int i = 0; i <= 2; i++) ctrl[i] = offtin(buf + 8 * i);
+  }
+
+  template <typename Type>
+  ssize_t read_diff(Type* buf, ssize_t size) {
+    return m_streams[section_diff]->read(reinterpret_cast<uint8_t*>(buf), size);
+  }
+
+  template <typename Type>
+  ssize_t read_extra(Type* buf, ssize_t size) {
+    return m_streams[section_extra]->read(reinterpret_cast<uint8_t*>(buf),
+                                          size);
+  }
+
+  ///
+  /// \brief Check if all control records have been read
+  /// \return true if there is no more records
+  ///
+  bool eof() { return m_streams[section_control]->eof(); }
+
+  ///
+  /// \brief Size of new file
+  ///
+  int64_t new_size() const { return m_new_size; }
+
+  ///
+  /// \brief Check if patch has index, required by seek()
+  ///
+  bool has_index() const { return !m_index.empty(); }
+
+  ///
+  /// \brief Index of patch, empty if patch format has no index
+  ///
+  const patch_index& index() const { return m_index; }
+
+  ///
+  /// \brief Continue reading section from given position
+  /// \param section Section to move
+  /// \param pos     Position in uncompressed section
+  /// \param limit   Number of bytes which will be read, -1 if not known
+  ///
+  void seek(patch_section section, int64_t pos, int64_t limit = -1) {
+    enforce_throw(has_index(), "Patch has no index");
+    int64_t offset =
+        m_section_offsets[section] + m_index.chunk_offset(section, pos);
+    m_streams[section] = std::make_shared<chunk_reader>(
+        m_file_path, offset, *m_pool, m_codecs[section],
+        pos % andiff_chunk_size, limit);
+  }
+
+  ///
+  /// \brief Create another reader of the same patch
+  /// Header and index are not read again. Sections are not opened, all of
+  /// them have to be positioned with seek() before reading.
+  /// \return New reader
+  ///
+  anpatch_reader detached() const {
+    enforce_throw(has_index(), "Patch has no index");
+    anpatch_reader reader;
+    reader.m_new_size = m_new_size;
+    reader.m_index = m_index;
+    reader.m_file_path = m_file_path;
+    reader.m_pool = m_pool;
+    reader.m_codecs = m_codecs;
+    reader.m_section_offsets = m_section_offsets;
+    return reader;
+  }
+
+  void close() {
+    for (auto& stream : m_streams) stream.reset();
+  }
+
+ private:
+  ssize_t read_all(patch_section section, uint8_t* buf, ssize_t size) {
+    ssize_t done = 0;
+    while (done < size && !m_streams[section]->eof()) {
+      done += m_streams[section]->read(buf + done, size - done);
+    }
+    return done;
+  }
+
+  std::array<std::shared_ptr<patch_stream>, 3> m_streams;  ///< patch_section
+  int64_t m_new_size = 0;                                  ///< From header
+  patch_index m_index;  ///< Seek points, empty in andiff_magic_bz2_stream
+  std::string m_file_path;         ///< Patch location, used by seek()
+  thread_pool* m_pool = nullptr;   ///< Decompression pool, used by seek()
+  /// Codec and beginning of every section, indexed by patch_section
+  std::array<std::shared_ptr<const base_codec>, 3> m_codecs;
+  std::array<int64_t, 3> m_section_offsets = {{0, 0, 0}};
 };
 
 #endif  // READERS_HPP
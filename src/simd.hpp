@@ -0,0 +1,457 @@
+/*-
+ * Copyright 2016 Jakub Nyckowski
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SIMD_HPP
+#define SIMD_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ANDIFF_SIMD_X86
+#include <immintrin.h>
+// AVX-512BW intrinsics are available since GCC 5 and Clang 3.9
+#if defined(__clang__)
+#if __clang_major__ > 3 || (__clang_major__ == 3 && __clang_minor__ >= 9)
+#define ANDIFF_SIMD_AVX512
+#endif
+#elif defined(__GNUC__) && __GNUC__ >= 5
+#define ANDIFF_SIMD_AVX512
+#endif
+#endif
+
+namespace simd {
+
+///
+/// \brief Kernel implementations, selected once at startup
+///
+enum class isa { scalar, sse2, avx2, avx512 };
+
+///
+/// \brief Load 8 bytes without alignment requirements
+///
+inline uint64_t load_u64(const uint8_t* p) {
+  uint64_t v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+///
+/// \brief Index of first different byte of two different 8 byte words
+///
+inline size_t first_diff_byte(uint64_t a, uint64_t b) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  return static_cast<size_t>(__builtin_clzll(a ^ b)) / 8;
+#else
+  return static_cast<size_t>(__builtin_ctzll(a ^ b)) / 8;
+#endif
+}
+
+inline size_t mismatch_scalar(const uint8_t* a, const uint8_t* b, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint64_t x = load_u64(a + i);
+    uint64_t y = load_u64(b + i);
+    if (x != y) return i + first_diff_byte(x, y);
+  }
+  for (; i < n; ++i)
+    if (a[i] != b[i]) break;
+  return i;
+}
+
+inline void subtract_scalar(uint8_t* out, const uint8_t* a, const uint8_t* b,
+                            size_t n) {
+  for (size_t i = 0; i < n; ++i) out[i] = static_cast<uint8_t>(a[i] - b[i]);
+}
+
+inline void add_scalar(uint8_t* data, const uint8_t* b, size_t n) {
+  for (size_t i = 0; i < n; ++i)
+    data[i] = static_cast<uint8_t>(data[i] + b[i]);
+}
+
+inline size_t count_scalar(const uint8_t* data, size_t n, uint8_t value) {
+  size_t count = 0;
+  for (size_t i = 0; i < n; ++i) count += data[i] == value;
+  return count;
+}
+
+#if defined(ANDIFF_SIMD_X86)
+__attribute__((target("sse2"))) inline size_t mismatch_sse2(const uint8_t* a,
+                                                            const uint8_t* b,
+                                                            size_t n) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+    __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+    unsigned mask =
+        static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)));
+    if (mask != 0xFFFF) return i + __builtin_ctz(~mask);
+  }
+  return i + mismatch_scalar(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2"))) inline size_t mismatch_avx2(const uint8_t* a,
+                                                            const uint8_t* b,
+                                                            size_t n) {
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+    __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+    unsigned mask =
+        static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)));
+    if (mask != 0xFFFFFFFFu) return i + __builtin_ctz(~mask);
+  }
+  return i + mismatch_sse2(a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2"))) inline void subtract_sse2(uint8_t* out,
+                                                          const uint8_t* a,
+                                                          const uint8_t* b,
+                                                          size_t n) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+    __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_sub_epi8(x, y));
+  }
+  subtract_scalar(out + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2"))) inline void add_sse2(uint8_t* data,
+                                                     const uint8_t* b,
+                                                     size_t n) {
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+    __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(data + i), _mm_add_epi8(x, y));
+  }
+  add_scalar(data + i, b + i, n - i);
+}
+
+__attribute__((target("avx2"))) inline void subtract_avx2(uint8_t* out,
+                                                          const uint8_t* a,
+                                                          const uint8_t* b,
+                                                          size_t n) {
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+    __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i),
+                        _mm256_sub_epi8(x, y));
+  }
+  subtract_sse2(out + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2"))) inline void add_avx2(uint8_t* data,
+                                                     const uint8_t* b,
+                                                     size_t n) {
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+    __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(data + i),
+                        _mm256_add_epi8(x, y));
+  }
+  add_sse2(data + i, b + i, n - i);
+}
+
+__attribute__((target("sse2"))) inline size_t count_sse2(const uint8_t* data,
+                                                         size_t n,
+                                                         uint8_t value) {
+  const __m128i v = _mm_set1_epi8(static_cast<char>(value));
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+    count += __builtin_popcount(
+        static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(x, v))));
+  }
+  return count + count_scalar(data + i, n - i, value);
+}
+
+__attribute__((target("avx2,popcnt"))) inline size_t count_avx2(
+    const uint8_t* data, size_t n, uint8_t value) {
+  const __m256i v = _mm256_set1_epi8(static_cast<char>(value));
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+    count += __builtin_popcount(
+        static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, v))));
+  }
+  return count + count_sse2(data + i, n - i, value);
+}
+#endif
+
+#if defined(ANDIFF_SIMD_AVX512)
+__attribute__((target("avx512f,avx512bw"))) inline size_t mismatch_avx512(
+    const uint8_t* a, const uint8_t* b, size_t n) {
+  size_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    __m512i x = _mm512_loadu_si512(a + i);
+    __m512i y = _mm512_loadu_si512(b + i);
+    uint64_t mask = _mm512_cmpneq_epi8_mask(x, y);
+    if (mask) return i + __builtin_ctzll(mask);
+  }
+  if (i < n) {
+    // Masked load never touches bytes past the end
+    __mmask64 tail = ~0ULL >> (64 - (n - i));
+    __m512i x = _mm512_maskz_loadu_epi8(tail, a + i);
+    __m512i y = _mm512_maskz_loadu_epi8(tail, b + i);
+    uint64_t mask = _mm512_mask_cmpneq_epi8_mask(tail, x, y);
+    return mask ? i + __builtin_ctzll(mask) : n;
+  }
+  return n;
+}
+
+__attribute__((target("avx512f,avx512bw"))) inline void subtract_avx512(
+    uint8_t* out, const uint8_t* a, const uint8_t* b, size_t n) {
+  size_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    __m512i x = _mm512_loadu_si512(a + i);
+    __m512i y = _mm512_loadu_si512(b + i);
+    _mm512_storeu_si512(out + i, _mm512_sub_epi8(x, y));
+  }
+  if (i < n) {
+    __mmask64 tail = ~0ULL >> (64 - (n - i));
+    __m512i x = _mm512_maskz_loadu_epi8(tail, a + i);
+    __m512i y = _mm512_maskz_loadu_epi8(tail, b + i);
+    _mm512_mask_storeu_epi8(out + i, tail, _mm512_sub_epi8(x, y));
+  }
+}
+
+__attribute__((target("avx512f,avx512bw"))) inline void add_avx512(
+    uint8_t* data, const uint8_t* b, size_t n) {
+  size_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    __m512i x = _mm512_loadu_si512(data + i);
+    __m512i y = _mm512_loadu_si512(b + i);
+    _mm512_storeu_si512(data + i, _mm512_add_epi8(x, y));
+  }
+  if (i < n) {
+    __mmask64 tail = ~0ULL >> (64 - (n - i));
+    __m512i x = _mm512_maskz_loadu_epi8(tail, data + i);
+    __m512i y = _mm512_maskz_loadu_epi8(tail, b + i);
+    _mm512_mask_storeu_epi8(data + i, tail, _mm512_add_epi8(x, y));
+  }
+}
+
+__attribute__((target("avx512f,avx512bw,popcnt"))) inline size_t count_avx512(
+    const uint8_t* data, size_t n, uint8_t value) {
+  const __m512i v = _mm512_set1_epi8(static_cast<char>(value));
+  size_t count = 0;
+  size_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    __m512i x = _mm512_loadu_si512(data + i);
+    count += __builtin_popcountll(_mm512_cmpeq_epi8_mask(x, v));
+  }
+  if (i < n) {
+    __mmask64 tail = ~0ULL >> (64 - (n - i));
+    __m512i x = _mm512_maskz_loadu_epi8(tail, data + i);
+    count += __builtin_popcountll(_mm512_mask_cmpeq_epi8_mask(tail, x, v));
+  }
+  return count;
+}
+#endif
+
+///
+/// \brief Detect best instruction set supported by processor
+/// \return Instruction set used by dispatched kernels
+///
+inline isa detect_isa() {
+#if defined(ANDIFF_SIMD_X86)
+  __builtin_cpu_init();
+#if defined(ANDIFF_SIMD_AVX512)
+  if (__builtin_cpu_supports("avx512bw")) return isa::avx512;
+#endif
+  if (__builtin_cpu_supports("avx2")) return isa::avx2;
+  if (__builtin_cpu_supports("sse2")) return isa::sse2;
+#endif
+  return isa::scalar;
+}
+
+using mismatch_fn = size_t (*)(const uint8_t*, const uint8_t*, size_t);
+
+inline mismatch_fn select_mismatch(isa level) {
+  switch (level) {
+#if defined(ANDIFF_SIMD_AVX512)
+    case isa::avx512:
+      return mismatch_avx512;
+#endif
+#if defined(ANDIFF_SIMD_X86)
+    case isa::avx2:
+      return mismatch_avx2;
+    case isa::sse2:
+      return mismatch_sse2;
+#endif
+    default:
+      return mismatch_scalar;
+  }
+}
+
+using subtract_fn = void (*)(uint8_t*, const uint8_t*, const uint8_t*,
+                             size_t);
+
+inline subtract_fn select_subtract(isa level) {
+  switch (level) {
+#if defined(ANDIFF_SIMD_AVX512)
+    case isa::avx512:
+      return subtract_avx512;
+#endif
+#if defined(ANDIFF_SIMD_X86)
+    case isa::avx2:
+      return subtract_avx2;
+    case isa::sse2:
+      return subtract_sse2;
+#endif
+    default:
+      return subtract_scalar;
+  }
+}
+
+using add_fn = void (*)(uint8_t*, const uint8_t*, size_t);
+
+inline add_fn select_add(isa level) {
+  switch (level) {
+#if defined(ANDIFF_SIMD_AVX512)
+    case isa::avx512:
+      return add_avx512;
+#endif
+#if defined(ANDIFF_SIMD_X86)
+    case isa::avx2:
+      return add_avx2;
+    case isa::sse2:
+      return add_sse2;
+#endif
+    default:
+      return add_scalar;
+  }
+}
+
+using count_fn = size_t (*)(const uint8_t*, size_t, uint8_t);
+
+inline count_fn select_count(isa level) {
+  switch (level) {
+#if defined(ANDIFF_SIMD_AVX512)
+    case isa::avx512:
+      return count_avx512;
+#endif
+#if defined(ANDIFF_SIMD_X86)
+    case isa::avx2:
+      return count_avx2;
+    case isa::sse2:
+      return count_sse2;
+#endif
+    default:
+      return count_scalar;
+  }
+}
+
+/// Instruction set detected at startup
+static const isa cpu_isa = detect_isa();
+
+/// Kernels for cpu_isa
+static const mismatch_fn mismatch_impl = select_mismatch(cpu_isa);
+static const subtract_fn subtract_impl = select_subtract(cpu_isa);
+static const add_fn add_impl = select_add(cpu_isa);
+static const count_fn count_impl = select_count(cpu_isa);
+
+///
+/// \brief Name of instruction set, for diagnostics
+///
+inline const char* isa_name(isa level) {
+  switch (level) {
+    case isa::avx512:
+      return "avx512";
+    case isa::avx2:
+      return "avx2";
+    case isa::sse2:
+      return "sse2";
+    default:
+      return "scalar";
+  }
+}
+
+}  // namespace simd
+
+///
+/// \brief Find first position where two buffers differ
+/// \param a First buffer
+/// \param b Second buffer
+/// \param n Number of bytes to compare
+/// \return Index of first different byte or n if buffers are equal
+///
+inline size_t find_mismatch(const uint8_t* a, const uint8_t* b, size_t n) {
+  // Most of comparisons in binary search end within a few bytes, check first
+  // word inline before paying for the call of vector kernel
+  if (n >= 8) {
+    uint64_t x = simd::load_u64(a);
+    uint64_t y = simd::load_u64(b);
+    if (x != y) return simd::first_diff_byte(x, y);
+    return 8 + simd::mismatch_impl(a + 8, b + 8, n - 8);
+  }
+  size_t i = 0;
+  for (; i < n; ++i)
+    if (a[i] != b[i]) break;
+  return i;
+}
+
+///
+/// \brief Compute diff bytes, out[i] = target[i] - source[i]
+/// \param out    Output buffer, may be the same as target
+/// \param target New data
+/// \param source Old data
+/// \param n      Number of bytes
+///
+inline void subtract_bytes(uint8_t* out, const uint8_t* target,
+                           const uint8_t* source, size_t n) {
+  simd::subtract_impl(out, target, source, n);
+}
+
+///
+/// \brief Apply diff bytes in place, data[i] += source[i]
+/// \param data   Diff bytes, replaced with new data
+/// \param source Old data
+/// \param n      Number of bytes
+///
+inline void add_bytes(uint8_t* data, const uint8_t* source, size_t n) {
+  simd::add_impl(data, source, n);
+}
+
+///
+/// \brief Count occurrences of byte
+/// \param data  Buffer
+/// \param n     Number of bytes
+/// \param value Counted byte
+/// \return Number of bytes equal to value
+///
+inline size_t count_byte(const uint8_t* data, size_t n, uint8_t value) {
+  return simd::count_impl(data, n, value);
+}
+
+#endif  // SIMD_HPP
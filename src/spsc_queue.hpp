@@ -0,0 +1,358 @@
+/*-
+ * Copyright 2016 Jakub Nyckowski
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SPSC_QUEUE_HPP
+#define SPSC_QUEUE_HPP
+
+#include "memory_budget.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <condition_variable>
+#include <mutex>
+#endif
+
+///
+/// \brief Flag a thread can sleep on until another thread clears it
+///
+/// Uses futex on Linux, mutex with condition variable elsewhere.
+///
+class parking_flag {
+ public:
+  parking_flag() : m_value(0) {}
+
+  ///
+  /// \brief Announce that the calling thread is going to sleep
+  ///
+  void arm() { m_value.store(1, std::memory_order_seq_cst); }
+
+  ///
+  /// \brief Sleep while flag is armed, can return spuriously
+  ///
+  void wait() {
+#if defined(__linux__)
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&m_value),
+            FUTEX_WAIT_PRIVATE, 1, nullptr, nullptr, 0);
+#else
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cv.wait(lock, [this]() { return m_value.load() == 0; });
+#endif
+  }
+
+  ///
+  /// \brief Wake sleeping thread, cheap when nobody sleeps
+  /// Caller has to issue sequentially consistent fence after publishing
+  /// data the sleeper waits for.
+  ///
+  void wake() {
+    if (m_value.load(std::memory_order_relaxed) == 0) return;
+    m_value.store(0, std::memory_order_seq_cst);
+#if defined(__linux__)
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&m_value),
+            FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+#else
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_cv.notify_one();
+#endif
+  }
+
+ private:
+  std::atomic<uint32_t> m_value;  ///< 1 when a thread sleeps or is about to
+#if !defined(__linux__)
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+#endif
+};
+
+///
+/// \brief Lock-free queue with one producer and one consumer
+///
+/// Elements are stored in a chain of fixed size segments. The producer
+/// publishes its index every few elements, so in common case push and pop
+/// touch only memory owned by the calling thread. A consumer without data
+/// spins for a while and then sleeps until the producer publishes more.
+///
+/// Segments can be charged to a memory_budget. The producer waits for the
+/// budget only while the consumer is not reading from this queue yet; the
+/// queue being drained always makes progress. After inserting all data
+/// spsc_queue::close has to be called.
+///
+template <typename T>
+class spsc_queue {
+ public:
+  /// Number of elements in one segment
+  static const size_t segment_size = 512;
+
+  ///
+  /// \brief Create queue
+  /// \param budget Memory limit shared with other queues, can be nullptr
+  ///
+  explicit spsc_queue(memory_budget *budget = nullptr);
+
+  spsc_queue(const spsc_queue &) = delete;
+  spsc_queue &operator=(const spsc_queue &) = delete;
+
+  ~spsc_queue();
+
+  ///
+  /// \brief Push data into queue
+  /// Can be called only by producer.
+  /// \param data Data
+  ///
+  void push(const T &data);
+
+  ///
+  /// \brief Close queue, no more data can be added
+  /// Can be called only by producer.
+  ///
+  void close();
+
+  ///
+  /// \brief Pop from queue, wait if data is not available
+  /// Can be called only by consumer.
+  /// \param data Output data
+  /// \return false if queue has been closed and there is no more elements
+  ///
+  bool wait_and_pop(T &data);
+
+  ///
+  /// \brief Pop many elements at once, wait if data is not available
+  /// Can be called only by consumer.
+  /// \param data Output array
+  /// \param size Size of output array
+  /// \return Number of popped elements, 0 if queue has been closed and
+  ///         there is no more elements
+  ///
+  size_t pop_batch(T *data, size_t size);
+
+ private:
+  struct segment {
+    segment() : next(nullptr) {}
+    T items[segment_size];
+    std::atomic<segment *> next;
+  };
+
+  /// Number of elements after which producer publishes its index
+  static const uint64_t publish_batch = 32;
+  /// Number of checks before consumer goes to sleep
+  static const unsigned spin_limit = 256;
+  // Padding keeps producer and consumer data in separate cache lines
+  static const size_t cache_line = 64;
+
+  static void cpu_relax();
+
+  segment *allocate_segment();
+  void free_segment(segment *seg);
+  void free_all();
+  void publish_tail();
+  bool wait_for_data();
+  const T &front();
+
+  memory_budget *const m_budget;
+  char m_pad0[cache_line];
+
+  // Producer side
+  std::atomic<uint64_t> m_tail;  ///< Published write index
+  uint64_t m_write;              ///< Local write index
+  segment *m_write_segment;      ///< Segment written by producer
+  char m_pad1[cache_line];
+
+  // Consumer side
+  uint64_t m_read;              ///< Local read index
+  uint64_t m_cached_tail;       ///< Last seen write index
+  segment *m_read_segment;      ///< Segment read by consumer
+  parking_flag m_consumer_sleep;
+  char m_pad2[cache_line];
+
+  std::atomic_bool m_closed;
+  std::atomic_bool m_draining;  ///< Consumer reads this queue
+  std::atomic<segment *> m_first;  ///< First segment, set by producer
+};
+
+template <typename T>
+const size_t spsc_queue<T>::segment_size;
+
+template <typename T>
+const uint64_t spsc_queue<T>::publish_batch;
+
+template <typename T>
+const unsigned spsc_queue<T>::spin_limit;
+
+template <typename T>
+const size_t spsc_queue<T>::cache_line;
+
+template <typename T>
+spsc_queue<T>::spsc_queue(memory_budget *budget)
+    : m_budget(budget),
+      m_tail(0),
+      m_write(0),
+      m_write_segment(nullptr),
+      m_read(0),
+      m_cached_tail(0),
+      m_read_segment(nullptr),
+      m_closed(false),
+      m_draining(false),
+      m_first(nullptr) {}
+
+template <typename T>
+spsc_queue<T>::~spsc_queue() {
+  free_all();
+}
+
+template <typename T>
+void spsc_queue<T>::free_all() {
+  segment *seg = m_read_segment ? m_read_segment : m_first.load();
+  while (seg) {
+    segment *next = seg->next.load();
+    free_segment(seg);
+    seg = next;
+  }
+  m_read_segment = nullptr;
+  m_first.store(nullptr);
+}
+
+template <typename T>
+void spsc_queue<T>::cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#endif
+}
+
+template <typename T>
+typename spsc_queue<T>::segment *spsc_queue<T>::allocate_segment() {
+  if (m_budget) m_budget->acquire(sizeof(segment), m_draining);
+  return new segment();
+}
+
+template <typename T>
+void spsc_queue<T>::free_segment(segment *seg) {
+  delete seg;
+  if (m_budget) m_budget->release(sizeof(segment));
+}
+
+template <typename T>
+void spsc_queue<T>::push(const T &data) {
+  size_t index = m_write % segment_size;
+  if (index == 0) {
+    segment *seg = allocate_segment();
+    if (m_write_segment) {
+      m_write_segment->next.store(seg, std::memory_order_release);
+    } else {
+      m_first.store(seg, std::memory_order_release);
+    }
+    m_write_segment = seg;
+  }
+  m_write_segment->items[index] = data;
+  ++m_write;
+  if (m_write % publish_batch == 0) publish_tail();
+}
+
+template <typename T>
+void spsc_queue<T>::close() {
+  publish_tail();
+  m_closed.store(true, std::memory_order_seq_cst);
+  m_consumer_sleep.wake();
+}
+
+template <typename T>
+const T &spsc_queue<T>::front() {
+  size_t index = m_read % segment_size;
+  if (index == 0) {
+    // Segment is linked before elements in it are published
+    segment *next = m_read_segment
+                        ? m_read_segment->next.load(std::memory_order_acquire)
+                        : m_first.load(std::memory_order_acquire);
+    if (m_read_segment) free_segment(m_read_segment);
+    m_read_segment = next;
+  }
+  return m_read_segment->items[index];
+}
+
+template <typename T>
+bool spsc_queue<T>::wait_and_pop(T &data) {
+  if (m_read == m_cached_tail && !wait_for_data()) return false;
+  data = front();
+  ++m_read;
+  return true;
+}
+
+template <typename T>
+size_t spsc_queue<T>::pop_batch(T *data, size_t size) {
+  if (m_read == m_cached_tail && !wait_for_data()) return 0;
+  size_t count = 0;
+  while (count < size && m_read != m_cached_tail) {
+    data[count++] = front();
+    ++m_read;
+  }
+  return count;
+}
+
+template <typename T>
+void spsc_queue<T>::publish_tail() {
+  m_tail.store(m_write, std::memory_order_release);
+  // Pairs with arm() in wait_for_data, either consumer sees new tail or
+  // producer sees the consumer is going to sleep
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  m_consumer_sleep.wake();
+}
+
+template <typename T>
+bool spsc_queue<T>::wait_for_data() {
+  if (!m_draining.load(std::memory_order_relaxed)) {
+    // From now on producer cannot wait for memory, it would wait for us
+    m_draining.store(true);
+    if (m_budget) m_budget->notify();
+  }
+  for (unsigned spin = 0;; ++spin) {
+    m_cached_tail = m_tail.load(std::memory_order_acquire);
+    if (m_cached_tail != m_read) return true;
+    if (m_closed.load(std::memory_order_acquire)) {
+      m_cached_tail = m_tail.load(std::memory_order_acquire);
+      if (m_cached_tail != m_read) return true;
+      // Drained, give memory back without waiting for destruction
+      free_all();
+      return false;
+    }
+    if (spin < spin_limit) {
+      cpu_relax();
+    } else {
+      m_consumer_sleep.arm();
+      if (m_tail.load(std::memory_order_seq_cst) == m_read &&
+          !m_closed.load(std::memory_order_seq_cst)) {
+        m_consumer_sleep.wait();
+      }
+    }
+  }
+}
+
+#endif  // SPSC_QUEUE_HPP
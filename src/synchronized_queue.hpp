@@ -144,8 +144,11 @@ bool synchronized_queue<T>::closed() const {
 
 template <typename T>
 void synchronized_queue<T>::close() {
-  m_closed = true;
-  m_cv.notify_one();
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_closed = true;
+  }
+  m_cv.notify_all();
 }
 
 template <typename T>
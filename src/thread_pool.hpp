@@ -0,0 +1,116 @@
+/*-
+ * Copyright 2016 Jakub Nyckowski
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include "synchronized_queue.hpp"
+
+#include <functional>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+
+///
+/// \brief Fixed size pool of worker threads
+///
+/// Tasks are executed in submission order by the first free worker. Results
+/// are returned through std::future, so a caller can keep submission order
+/// even when tasks finish out of order.
+///
+class thread_pool {
+ public:
+  ///
+  /// \brief Start worker threads
+  /// \param threads_number Number of worker threads, at least one is created
+  ///
+  explicit thread_pool(uint32_t threads_number);
+
+  thread_pool(const thread_pool&) = delete;
+  thread_pool& operator=(const thread_pool&) = delete;
+
+  ///
+  /// \brief Destructor
+  /// Waits until all submitted tasks are finished
+  ///
+  ~thread_pool();
+
+  ///
+  /// \brief Queue task for execution
+  /// \param task Callable object without arguments
+  /// \return Future with result of the task
+  ///
+  template <typename F>
+  auto submit(F task) -> std::future<decltype(task())>;
+
+  ///
+  /// \brief Get number of worker threads
+  /// \return Number of worker threads
+  ///
+  uint32_t size() const;
+
+ private:
+  void worker();
+
+  synchronized_queue<std::function<void()>> m_tasks;  ///< Pending tasks
+  std::vector<std::thread> m_threads;                 ///< Worker threads
+};
+
+inline thread_pool::thread_pool(uint32_t threads_number)
+    : m_threads(std::max<uint32_t>(threads_number, 1)) {
+  for (auto& t : m_threads) t = std::thread(&thread_pool::worker, this);
+}
+
+inline thread_pool::~thread_pool() {
+  m_tasks.close();
+  for (auto& t : m_threads) t.join();
+}
+
+template <typename F>
+auto thread_pool::submit(F task) -> std::future<decltype(task())> {
+  using result_type = decltype(task());
+  // std::function requires copyable callable, so packaged_task is shared
+  auto packaged =
+      std::make_shared<std::packaged_task<result_type()>>(std::move(task));
+  std::future<result_type> result = packaged->get_future();
+  std::function<void()> wrapper = [packaged]() { (*packaged)(); };
+  m_tasks.push(wrapper);
+  return result;
+}
+
+inline uint32_t thread_pool::size() const {
+  return static_cast<uint32_t>(m_threads.size());
+}
+
+inline void thread_pool::worker() {
+  std::function<void()> task;
+  while (m_tasks.wait_and_pop(task)) {
+    task();
+  }
+}
+
+#endif  // THREAD_POOL_HPP
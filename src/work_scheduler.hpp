@@ -0,0 +1,218 @@
+/*-
+ * Copyright 2016 Jakub Nyckowski
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef WORK_SCHEDULER_HPP
+#define WORK_SCHEDULER_HPP
+
+#include "memory_budget.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+///
+/// \brief Range of target processed by one worker
+///
+/// Worker stops soon after it passes end. The end can be moved back by
+/// another worker, which takes over the rest of the range. Output is a
+/// queue with push() and close(), read by the consumer of results.
+///
+template <typename T, typename Output>
+struct work_block {
+  template <typename... Args>
+  work_block(T range_start, T range_end, Args &&... output_args)
+      : start(range_start),
+        end(range_end),
+        progress(range_start),
+        done(false),
+        next(nullptr),
+        output(std::forward<Args>(output_args)...) {}
+
+  work_block(const work_block &) = delete;
+  work_block &operator=(const work_block &) = delete;
+
+  const T start;                    ///< Beginning of range
+  std::atomic<T> end;               ///< End of range, can only shrink
+  std::atomic<T> progress;          ///< Position reached by worker
+  bool done;                        ///< Worker finished, guarded by scheduler
+  work_block *next;                 ///< Next block in target order
+  Output output;                    ///< Results of worker
+};
+
+///
+/// \brief Splits target between workers, idle workers steal work
+///
+/// Target is cut into one range per worker. When a worker finishes its
+/// range it takes the second half of the largest range still being
+/// processed. Blocks are kept in target order, so results can be consumed
+/// sequentially with first() and next(). Outputs of all blocks are created
+/// with the same memory budget.
+///
+template <typename T, typename Output>
+class work_scheduler {
+ public:
+  using block = work_block<T, Output>;
+
+  ///
+  /// \brief Create initial ranges
+  /// \param size      Size of whole range
+  /// \param workers   Number of workers
+  /// \param min_split Shortest piece left by a split, remaining ranges
+  ///                  shorter than twice it are not split
+  /// \param budget    Memory budget passed to outputs of blocks
+  ///
+  work_scheduler(T size, uint32_t workers, T min_split,
+                 memory_budget *budget);
+
+  work_scheduler(const work_scheduler &) = delete;
+  work_scheduler &operator=(const work_scheduler &) = delete;
+
+  ///
+  /// \brief Get initial block of worker
+  /// \param worker Worker index
+  /// \return Block or nullptr if worker should start with stealing
+  ///
+  block *initial(uint32_t worker);
+
+  ///
+  /// \brief Take over part of the largest range still being processed
+  /// \return New block or nullptr if nothing is worth splitting
+  ///
+  block *steal();
+
+  ///
+  /// \brief Mark block as processed, it cannot be split anymore
+  /// \param b Block returned by initial() or steal()
+  ///
+  void finish(block *b);
+
+  ///
+  /// \brief First block in target order
+  ///
+  block *first();
+
+  ///
+  /// \brief Next block in target order
+  /// Waits until b is finished, so no block can be added after it later.
+  /// \param b Current block
+  /// \return Next block or nullptr after the last one
+  ///
+  block *next(block *b);
+
+ private:
+  std::mutex m_mutex;
+  std::condition_variable m_finished;
+  std::list<block> m_blocks;      ///< Storage of blocks, not ordered
+  std::vector<block *> m_initial;  ///< Initial block of each worker
+  const T m_min_split;
+  memory_budget *const m_budget;
+};
+
+template <typename T, typename Output>
+work_scheduler<T, Output>::work_scheduler(T size, uint32_t workers,
+                                          T min_split, memory_budget *budget)
+    : m_min_split(std::max<T>(1, min_split)), m_budget(budget) {
+  T count = std::max<T>(
+      1, std::min<T>(static_cast<T>(std::max<uint32_t>(workers, 1)),
+                     size / m_min_split));
+  T range_start = 0;
+  block *prev = nullptr;
+  for (T i = 0; i < count; ++i) {
+    T range_end = i + 1 == count ? size : range_start + size / count;
+    m_blocks.emplace_back(range_start, range_end, m_budget);
+    block *b = &m_blocks.back();
+    if (prev) prev->next = b;
+    prev = b;
+    m_initial.push_back(b);
+    range_start = range_end;
+  }
+}
+
+template <typename T, typename Output>
+typename work_scheduler<T, Output>::block *work_scheduler<T, Output>::initial(
+    uint32_t worker) {
+  return worker < m_initial.size() ? m_initial[worker] : nullptr;
+}
+
+template <typename T, typename Output>
+typename work_scheduler<T, Output>::block *work_scheduler<T, Output>::steal() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  block *victim = nullptr;
+  T victim_remaining = 0;
+  for (auto &b : m_blocks) {
+    if (b.done) continue;
+    T remaining = b.end.load(std::memory_order_relaxed) -
+                  b.progress.load(std::memory_order_relaxed);
+    if (remaining > victim_remaining) {
+      victim = &b;
+      victim_remaining = remaining;
+    }
+  }
+  // Both halves have to be worth the cost of repairing the seam
+  if (!victim || victim_remaining < 2 * m_min_split) return nullptr;
+
+  T split = victim->progress.load(std::memory_order_relaxed) +
+            victim_remaining / 2;
+  m_blocks.emplace_back(split, victim->end.load(std::memory_order_relaxed),
+                        m_budget);
+  block *b = &m_blocks.back();
+  // Victim may already be past split, overlapping results are skipped by
+  // the consumer
+  victim->end.store(split, std::memory_order_relaxed);
+  b->next = victim->next;
+  victim->next = b;
+  return b;
+}
+
+template <typename T, typename Output>
+void work_scheduler<T, Output>::finish(block *b) {
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    b->done = true;
+  }
+  m_finished.notify_all();
+}
+
+template <typename T, typename Output>
+typename work_scheduler<T, Output>::block *work_scheduler<T, Output>::first() {
+  std::lock_guard<std::mutex> lock(m_mutex);
+  return m_blocks.empty() ? nullptr : &m_blocks.front();
+}
+
+template <typename T, typename Output>
+typename work_scheduler<T, Output>::block *work_scheduler<T, Output>::next(
+    block *b) {
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_finished.wait(lock, [b]() { return b->done; });
+  return b->next;
+}
+
+#endif  // WORK_SCHEDULER_HPP
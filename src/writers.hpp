@@ -27,36 +27,26 @@
 #ifndef WRITERS_HPP
 #define WRITERS_HPP
 
+#include "andiff_private.hpp"
+#include "codecs.hpp"
 #include "enforce.hpp"
+#include "patch_index.hpp"
+#include "thread_pool.hpp"
 
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <deque>
+#include <future>
 #include <memory>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include <fcntl.h>
+#include <stdlib.h>
 #include <unistd.h>
 
-#include <bzlib.h>
-
-#if 0
-/// Unused interface
-class base_data_writer {
- public:
-  ///
-  /// \param file_path
-  ///
-  virtual void open(const std::string& file_path) = 0;
-  ///
-  /// \param buf
-  /// \param size
-  /// \return
-  ///
-  virtual ssize_t write(std::uint8_t* buf, ssize_t size) = 0;
-
-  virtual bool eof() = 0;
-
-  virtual void close() = 0;
-};
-#endif
 
 class file_writer {
  public:
@@ -66,17 +56,44 @@ class file_writer {
   void open(const std::string& file_path) {
     m_fd = ::open(file_path.c_str(), O_CREAT | O_WRONLY | O_TRUNC,
                   S_IRUSR | S_IWUSR);
-    enforce(m_fd > 0, "Cannot open file for write");
+    enforce_throw(m_fd > 0, "Cannot open file for write");
   }
 
   template <typename Type>
   ssize_t write(Type* buf, ssize_t size) {
     ssize_t chunk = ::write(m_fd, buf, size);
-    enforce(chunk > 0, "Read 0 bytes");
+    enforce_throw(chunk > 0, "Read 0 bytes");
     m_curr_pos += chunk;
     return chunk;
   }
 
+  ///
+  /// \brief Write data at given position, can be called from many threads
+  /// \param buf    Data to write
+  /// \param size   Size of data
+  /// \param offset Position in file
+  ///
+  template <typename Type>
+  void write_at(Type* buf, ssize_t size, int64_t offset) {
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(buf);
+    ssize_t written = 0;
+    while (written < size) {
+      ssize_t chunk =
+          ::pwrite(m_fd, data + written, size - written, offset + written);
+      enforce_throw(chunk > 0, "Write error");
+      written += chunk;
+    }
+  }
+
+  ///
+  /// \brief Set size of file, required before write_at
+  /// \param size New size of file
+  ///
+  void resize(int64_t size) {
+    enforce_throw(::ftruncate(m_fd, size) == 0,
+                  "Cannot resize output, it has to be a regular file");
+  }
+
   void close() { ::close(m_fd); }
 
  private:
@@ -84,14 +101,156 @@ class file_writer {
   ssize_t m_curr_pos;
 };
 
+///
+/// \brief Writer of one chunk stream
+///
+/// Data is cut into chunks of andiff_chunk_size bytes. Every chunk is
+/// compressed independently on the thread pool and written to the file in
+/// the same order as it was cut. Stream is terminated by a chunk header with
+/// zero size.
+///
+class chunk_writer {
+  /// Chunk header and compressed data
+  using compressed_chunk =
+      std::pair<std::vector<uint8_t>, std::vector<uint8_t>>;
+
+ public:
+  chunk_writer() : m_fd(nullptr), m_written(0), m_pool(nullptr) {}
+
+  chunk_writer(const chunk_writer&) = delete;
+  chunk_writer& operator=(const chunk_writer&) = delete;
+
+  ///
+  /// \brief Start writing stream
+  /// \param fd    Output file, it is not closed by chunk_writer
+  /// \param pool  Thread pool used for chunk compression
+  /// \param codec Codec used for chunk compression
+  ///
+  void open(FILE* fd, thread_pool& pool,
+            std::shared_ptr<const base_codec> codec) {
+    m_fd = fd;
+    m_written = 0;
+    m_offsets.clear();
+    m_pool = &pool;
+    m_codec = std::move(codec);
+    m_chunk.reserve(andiff_chunk_size);
+  }
+
+  template <typename Type>
+  ssize_t write(Type* buf, ssize_t size) {
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(buf);
+    ssize_t written = 0;
+    while (written < size) {
+      size_t to_copy = std::min<size_t>(size - written,
+                                        andiff_chunk_size - m_chunk.size());
+      m_chunk.insert(m_chunk.end(), data + written, data + written + to_copy);
+      written += to_copy;
+      if (m_chunk.size() == static_cast<size_t>(andiff_chunk_size)) {
+        flush_chunk();
+      }
+    }
+
+    return size;
+  }
+
+  ///
+  /// \brief Write all pending chunks and stream terminator
+  /// \return Number of bytes written to file
+  ///
+  int64_t finish() {
+    if (!m_chunk.empty()) flush_chunk();
+    while (!m_pending.empty()) write_oldest();
+
+    m_offsets.push_back(m_written);
+    uint8_t terminator[andiff_chunk_header_size] = {0};
+    enforce(fwrite(terminator, sizeof(terminator), 1, m_fd) == 1,
+            "Failed to write chunk");
+    m_written += sizeof(terminator);
+    return m_written;
+  }
+
+  ///
+  /// \brief Offsets of chunks and of terminator, valid after finish()
+  /// \return Offsets relative to beginning of stream
+  ///
+  std::vector<int64_t> chunk_offsets() const { return m_offsets; }
+
+ private:
+  void flush_chunk() {
+    if (m_pending.size() >= 2 * m_pool->size()) write_oldest();
+
+    std::vector<uint8_t> chunk;
+    chunk.reserve(andiff_chunk_size);
+    chunk.swap(m_chunk);
+    auto data = std::make_shared<std::vector<uint8_t>>(std::move(chunk));
+    std::shared_ptr<const base_codec> codec = m_codec;
+    m_pending.push_back(m_pool->submit([data, codec]() {
+      std::vector<uint8_t> compressed =
+          codec->compress(data->data(), data->size());
+      std::vector<uint8_t> header(andiff_chunk_header_size);
+      offtout(static_cast<int64_t>(data->size()), header.data());
+      offtout(static_cast<int64_t>(compressed.size()), header.data() + 8);
+      return std::make_pair(std::move(header), std::move(compressed));
+    }));
+  }
+
+  void write_oldest() {
+    auto chunk = m_pending.front().get();
+    m_pending.pop_front();
+    m_offsets.push_back(m_written);
+    enforce(fwrite(chunk.first.data(), chunk.first.size(), 1, m_fd) == 1 &&
+                (chunk.second.empty() ||
+                 fwrite(chunk.second.data(), chunk.second.size(), 1, m_fd) ==
+                     1),
+            "Failed to write chunk");
+    m_written += chunk.first.size() + chunk.second.size();
+  }
+
+  FILE* m_fd;
+  int64_t m_written;             ///< Bytes written to file
+  thread_pool* m_pool;           ///< Pool used for compression
+  std::shared_ptr<const base_codec> m_codec;  ///< Chunk compression
+  std::vector<uint8_t> m_chunk;               ///< Chunk being filled
+  std::deque<std::future<compressed_chunk>> m_pending;  ///< In order
+  std::vector<int64_t> m_offsets;  ///< Offsets of written chunks
+};
+
+///
+/// \brief Patch writer
+///
+/// Control records, diff bytes and extra bytes are written to three separate
+/// chunk streams. Streams are spooled to temporary files next to the patch,
+/// because their sizes have to be stored in the header before the data.
+/// Positions of all cursors are tracked while records are written, they
+/// are stored in patch_index after the sections.
+///
 class andiff_writer {
  public:
-  andiff_writer() = default;
-  andiff_writer(andiff_writer& a) = default;
+  ///
+  /// \brief Constructor
+  /// \param pool   Thread pool used for chunk compression
+  /// \param codecs Codec of every section, indexed by patch_section
+  ///
+  andiff_writer(thread_pool& pool, const std::array<codec_id, 3>& codecs)
+      : m_fd(nullptr),
+        m_pool(pool),
+        m_codecs(codecs),
+        m_spools{{nullptr, nullptr, nullptr}},
+        m_new_pos(0),
+        m_old_pos(0),
+        m_section_pos{{0, 0, 0}} {}
+
+  andiff_writer(const andiff_writer&) = delete;
+  andiff_writer& operator=(const andiff_writer&) = delete;
 
   void open(const std::string& file_path) {
     m_fd = std::fopen(file_path.c_str(), "wb");
-    enforce(m_fd > 0, "Cannot open file for write");
+    enforce(m_fd != nullptr, "Cannot open file for write");
+
+    for (size_t i = 0; i < m_spools.size(); ++i) {
+      m_spools[i] = open_spool(file_path);
+      m_sections[i].open(m_spools[i], m_pool, make_codec(m_codecs[i]));
+    }
   }
 
   template <typename T, size_t Size>
@@ -99,33 +258,110 @@ class andiff_writer {
     constexpr size_t string_size = Size - 1;  // Remove null character
     static_assert(string_size == 16, "Magic size is different");
     static_assert(sizeof(new_size) == 8, "New file header has different size");
+    std::array<uint8_t, andiff_codecs_size> codecs = {};
+    for (size_t i = 0; i < m_codecs.size(); ++i) {
+      codecs[i] = static_cast<uint8_t>(m_codecs[i]);
+    }
     enforce(fwrite(magic, string_size, 1, m_fd) == 1 &&
-                fwrite(&new_size, sizeof(new_size), 1, m_fd) == 1,
+                fwrite(&new_size, sizeof(new_size), 1, m_fd) == 1 &&
+                fwrite(codecs.data(), codecs.size(), 1, m_fd) == 1,
             "Failed to write header");
   }
 
-  void open_bz_stream() {
-    bz2 = BZ2_bzWriteOpen(&bz2err, m_fd, 9, 0, 0);
-    enforce(bz2, "Cannot open bz2 stream");
+  ///
+  /// \brief Write control record
+  /// \param diff_size  Number of diff bytes
+  /// \param extra_size Number of extra bytes
+  /// \param seek       Offset added to old file position after extra bytes
+  ///
+  void write_control(int64_t diff_size, int64_t extra_size, int64_t seek) {
+    if (m_index.needs_point(m_new_pos)) {
+      m_index.add_point({m_new_pos, m_old_pos, m_section_pos});
+    }
+    m_new_pos += diff_size + extra_size;
+    m_old_pos += diff_size + seek;
+
+    std::array<uint8_t, 8 * 3> buf;
+    offtout(diff_size, buf.data());
+    offtout(extra_size, buf.data() + 8);
+    offtout(seek, buf.data() + 16);
+    write_section(section_control, buf.data(), buf.size());
   }
 
   template <typename Type>
-  ssize_t write(Type* buf, ssize_t size) {
-    int bz2err;
-    BZ2_bzWrite(&bz2err, bz2, const_cast<Type*>(buf), size);
-    enforce(bz2err == BZ_OK, "Error while writing bz2 data");
+  ssize_t write_diff(Type* buf, ssize_t size) {
+    return write_section(section_diff, buf, size);
+  }
 
-    return size;
+  template <typename Type>
+  ssize_t write_extra(Type* buf, ssize_t size) {
+    return write_section(section_extra, buf, size);
   }
 
   void close() {
-    BZ2_bzWriteClose(&bz2err, bz2, 0, NULL, NULL);
+    std::array<int64_t, 4> sizes;
+    for (size_t i = 0; i < m_sections.size(); ++i) {
+      sizes[i] = m_sections[i].finish();
+      m_index.set_chunk_offsets(static_cast<patch_section>(i),
+                                m_sections[i].chunk_offsets());
+    }
+    std::vector<uint8_t> index = m_index.serialize();
+    sizes[3] = static_cast<int64_t>(index.size());
+
+    std::array<uint8_t, 8 * 4> buf;
+    for (size_t i = 0; i < sizes.size(); ++i) {
+      offtout(sizes[i], buf.data() + 8 * i);
+    }
+    enforce(fwrite(buf.data(), buf.size(), 1, m_fd) == 1,
+            "Failed to write header");
+
+    std::vector<uint8_t> copy_buffer(1024 * 1024);
+    for (FILE* spool : m_spools) {
+      std::rewind(spool);
+      size_t read;
+      while ((read = fread(copy_buffer.data(), 1, copy_buffer.size(), spool)) >
+             0) {
+        enforce(fwrite(copy_buffer.data(), read, 1, m_fd) == 1,
+                "Failed to write section");
+      }
+      enforce(!std::ferror(spool), "Failed to read section");
+      std::fclose(spool);
+    }
+    enforce(fwrite(index.data(), index.size(), 1, m_fd) == 1,
+            "Failed to write index");
     std::fclose(m_fd);
   }
 
  private:
+  template <typename Type>
+  ssize_t write_section(patch_section section, Type* buf, ssize_t size) {
+    m_section_pos[section] += size;
+    return m_sections[section].write(buf, size);
+  }
+
+  ///
+  /// \brief Create anonymous temporary file in the directory of the patch
+  /// \param file_path Patch location
+  /// \return Opened file, removed from file system
+  ///
+  static FILE* open_spool(const std::string& file_path) {
+    std::string spool_path = file_path + ".XXXXXX";
+    int fd = ::mkstemp(&spool_path[0]);
+    enforce(fd != -1, "Cannot create temporary file");
+    ::unlink(spool_path.c_str());
+    FILE* spool = ::fdopen(fd, "w+b");
+    enforce(spool != nullptr, "Cannot create temporary file");
+    return spool;
+  }
+
   FILE* m_fd;
-  BZFILE* bz2;
-  int bz2err;
+  thread_pool& m_pool;                     ///< Pool used for compression
+  const std::array<codec_id, 3> m_codecs;  ///< Indexed by patch_section
+  std::array<chunk_writer, 3> m_sections;  ///< Indexed by patch_section
+  std::array<FILE*, 3> m_spools;           ///< Files with sections data
+  patch_index m_index;                     ///< Seek points and chunks
+  int64_t m_new_pos;                       ///< New file position
+  int64_t m_old_pos;                       ///< Old file position
+  std::array<int64_t, 3> m_section_pos;    ///< Uncompressed section sizes
 };
 #endif  // WRITERS_HPP
@@ -6,6 +6,7 @@
 """
 
 import os
+import random
 import time
 import tempfile
 import hashlib
@@ -84,6 +85,44 @@ def create_tmp_file(tmp_dir, file_size):
     return tmp_file
 
 
+def create_mutated_file(tmp_dir, source_file):
+    """ Create copy of source file with scattered replaced, inserted and
+    deleted bytes, so it has matches a few hundred bytes long with source
+
+    Args:
+        tmp_dir: Directory where file should be created
+        source_file: File which is copied
+
+    Returns:
+        str: Created filename
+    """
+    with open(source_file, 'rb') as file:
+        source_data = file.read()
+
+    pieces = []
+    copied = 0
+    positions = sorted(random.randrange(len(source_data) + 1)
+                       for _ in range(len(source_data) // 170))
+    for position in positions:
+        position = max(position, copied)
+        pieces.append(source_data[copied:position])
+        edit = random.randrange(3)
+        if edit == 0:  # Replace
+            pieces.append(os.urandom(1))
+            copied = min(position + 1, len(source_data))
+        elif edit == 1:  # Insert
+            pieces.append(os.urandom(1))
+            copied = position
+        else:  # Delete
+            copied = min(position + 1, len(source_data))
+    pieces.append(source_data[copied:])
+
+    tmp_file_fd, tmp_file = tempfile.mkstemp(dir=tmp_dir)
+    os.write(tmp_file_fd, b''.join(pieces))
+    os.close(tmp_file_fd)
+    return tmp_file
+
+
 def calculate_file_hash(filename):
     """ Calculate MD5 check-sum for given file
 
@@ -113,7 +152,44 @@ def run_application(args):
     logging.debug('Command took %fs', elapsed)
 
 
-def run_test(tmp_dir, files_size, andiff_app, anpatch_app):
+def check_ranges(tmp_dir, anpatch_app, source_file, target_file, patch_file,
+                 ranges_number):
+    """ Rebuild random ranges of target file and compare them with target
+
+    Args:
+        tmp_dir: Temporary directory for test
+        anpatch_app: Location of anpatch app
+        source_file: Source file
+        target_file: Target file
+        patch_file: Patch from source to target
+        ranges_number: Number of checked ranges
+    """
+    with open(target_file, 'rb') as file:
+        target_data = file.read()
+    size = len(target_data)
+    range_file = create_tmp_file(tmp_dir=tmp_dir, file_size=0)
+
+    ranges = [(0, size), (size, size)]
+    for _ in range(ranges_number):
+        begin = random.randint(0, size)
+        ranges.append((begin, random.randint(begin, size)))
+
+    for begin, end in ranges:
+        logging.debug('Running anpatch for range %d:%d', begin, end)
+        run_application((anpatch_app, '--range=%d:%d' % (begin, end),
+                         source_file, range_file, patch_file))
+        with open(range_file, 'rb') as file:
+            if file.read() != target_data[begin:end]:
+                logging.critical('Range result: ' + CmdColors.make_red('FAIL'))
+                raise Exception('Range %d:%d differs. Leaving broken files' % (begin, end))
+    logging.info('Range result: ' + CmdColors.make_green('OK'))
+    os.unlink(range_file)
+
+
+def run_test(tmp_dir, files_size, andiff_app, anpatch_app, diff_args,
+             use_index=False, targets_number=1, ranges_number=0, patch_args=(),
+             reference_args=None, mutated_targets=False,
+             max_patch_ratio=None):
     """ Run actual test
 
     Args:
@@ -121,39 +197,104 @@ def run_test(tmp_dir, files_size, andiff_app, anpatch_app):
         files_size: Size of temporary file in bytes
         andiff_app: Location of andiff app
         anpatch_app: Location of anpatch app
+        diff_args: Additional andiff arguments
+        use_index: Build index of source file and diff again using it
+        targets_number: Number of target files diffed in one andiff run
+        ranges_number: Number of random ranges rebuilt from every patch
+        patch_args: Additional anpatch arguments
+        reference_args: andiff arguments of run which has to give the same
+            patch, None when patch is not compared
+        mutated_targets: Make targets edited copies of source instead of
+            unrelated random data
+        max_patch_ratio: Largest allowed size of patch relative to its
+            target, None when size is not checked
     """
     source_file = create_tmp_file(tmp_dir=tmp_dir, file_size=files_size)
     logging.debug('Creating source file %s of size %s KB', source_file, files_size)
 
-    target_file = create_tmp_file(tmp_dir=tmp_dir, file_size=files_size)
-    logging.debug('Creating target file %s of size %s KB', target_file, files_size)
+    target_files = []
+    patch_files = []
+    for _ in range(targets_number):
+        if mutated_targets:
+            target_file = create_mutated_file(tmp_dir=tmp_dir,
+                                              source_file=source_file)
+        else:
+            target_file = create_tmp_file(tmp_dir=tmp_dir, file_size=files_size)
+        logging.debug('Creating target file %s of size %s KB', target_file, files_size)
+        target_files.append(target_file)
 
-    patch_file = create_tmp_file(tmp_dir=tmp_dir, file_size=0)
-    logging.debug('Patch file has been created: %s', patch_file)
+        patch_file = create_tmp_file(tmp_dir=tmp_dir, file_size=0)
+        logging.debug('Patch file has been created: %s', patch_file)
+        patch_files.append(patch_file)
+
+    index_file = None
+    if use_index:
+        index_file = os.path.join(tmp_dir, 'source.idx')
+        diff_args = diff_args + ['--index=' + index_file]
+
+    pairs = [name for pair in zip(target_files, patch_files) for name in pair]
 
     logging.debug('Running andiff')
-    run_application((andiff_app, source_file, target_file, patch_file))
+    run_application([andiff_app] + diff_args + [source_file] + pairs)
 
     patched_file = create_tmp_file(tmp_dir=tmp_dir, file_size=0)
     logging.debug('Patched file has been created: %s', patched_file)
 
-    logging.debug('Running anpatch')
-    run_application((anpatch_app, source_file, patched_file, patch_file))
-
-    logging.debug('Calculating hashes')
-    target_file_md5 = calculate_file_hash(target_file)
-    logging.debug('Target file: %s', target_file_md5)
-
-    patched_file_md5 = calculate_file_hash(patched_file)
-    logging.debug('Patched file: %s', patched_file_md5)
-
-    if patched_file_md5 == target_file_md5:
-        logging.info('Result: ' + CmdColors.make_green('OK'))
-    else:
-        logging.critical('Result: ' + CmdColors.make_red('FAIL'))
-        raise Exception('Something went wrong. Leaving broken files')
-
-    for file_to_remove in [target_file, source_file, patched_file, patch_file]:
+    for target_file, patch_file in zip(target_files, patch_files):
+        logging.debug('Running anpatch')
+        run_application([anpatch_app] + list(patch_args) +
+                        [source_file, patched_file, patch_file])
+
+        logging.debug('Calculating hashes')
+        target_file_md5 = calculate_file_hash(target_file)
+        logging.debug('Target file: %s', target_file_md5)
+
+        patched_file_md5 = calculate_file_hash(patched_file)
+        logging.debug('Patched file: %s', patched_file_md5)
+
+        if patched_file_md5 == target_file_md5:
+            logging.info('Result: ' + CmdColors.make_green('OK'))
+        else:
+            logging.critical('Result: ' + CmdColors.make_red('FAIL'))
+            raise Exception('Something went wrong. Leaving broken files')
+
+        if max_patch_ratio is not None:
+            patch_size = os.path.getsize(patch_file)
+            target_size = os.path.getsize(target_file)
+            if patch_size > max_patch_ratio * target_size:
+                logging.critical('Size result: ' + CmdColors.make_red('FAIL'))
+                raise Exception('Patch has %d bytes for target of %d bytes. '
+                                'Leaving broken files' % (patch_size, target_size))
+            logging.info('Size result: ' + CmdColors.make_green('OK'))
+
+        if ranges_number:
+            check_ranges(tmp_dir, anpatch_app, source_file, target_file,
+                         patch_file, ranges_number)
+
+    if index_file:
+        logging.debug('Running andiff with index %s', index_file)
+        indexed_patch_file = create_tmp_file(tmp_dir=tmp_dir, file_size=0)
+        run_application([andiff_app] + diff_args +
+                        [source_file, target_files[0], indexed_patch_file])
+        if calculate_file_hash(indexed_patch_file) != calculate_file_hash(patch_files[0]):
+            logging.critical('Index result: ' + CmdColors.make_red('FAIL'))
+            raise Exception('Patch generated with index differs. Leaving broken files')
+        logging.info('Index result: ' + CmdColors.make_green('OK'))
+        os.unlink(indexed_patch_file)
+        os.unlink(index_file)
+
+    if reference_args is not None:
+        logging.debug('Running andiff with reference arguments')
+        reference_patch_file = create_tmp_file(tmp_dir=tmp_dir, file_size=0)
+        run_application([andiff_app] + reference_args +
+                        [source_file, target_files[0], reference_patch_file])
+        if calculate_file_hash(reference_patch_file) != calculate_file_hash(patch_files[0]):
+            logging.critical('Reference result: ' + CmdColors.make_red('FAIL'))
+            raise Exception('Patch differs from reference. Leaving broken files')
+        logging.info('Reference result: ' + CmdColors.make_green('OK'))
+        os.unlink(reference_patch_file)
+
+    for file_to_remove in target_files + patch_files + [source_file, patched_file]:
         os.unlink(file_to_remove)
 
 
@@ -167,6 +308,25 @@ def main():
                         help='Location of anpatch application')
     parser.add_argument('--size', type=int, default=10, help='Size of test file')
     parser.add_argument('--repeat', type=int, default=1, help='Repeat test n times')
+    parser.add_argument('--diff-args', type=str, default='',
+                        help='Additional andiff arguments separated by spaces')
+    parser.add_argument('--patch-args', type=str, default='',
+                        help='Additional anpatch arguments separated by spaces')
+    parser.add_argument('--use-index', action='store_true',
+                        help='Check that andiff gives the same patch with index')
+    parser.add_argument('--targets', type=int, default=1,
+                        help='Number of target files diffed in one andiff run')
+    parser.add_argument('--ranges', type=int, default=0,
+                        help='Number of random ranges rebuilt from patch')
+    parser.add_argument('--reference-args', type=str, default=None,
+                        help='Check that andiff with these arguments separated '
+                        'by spaces gives the same patch')
+    parser.add_argument('--mutated-targets', action='store_true',
+                        help='Make target files edited copies of source file, '
+                        'so they share long matches')
+    parser.add_argument('--max-patch-ratio', type=float, default=None,
+                        help='Check that patch is at most this fraction of '
+                        'target file size')
     parser.add_argument('-v,--verbose', dest='verbose', action='store_true',
                         help='Repeat test n times')
 
@@ -200,7 +360,16 @@ def main():
 
     for _ in itertools.repeat(None, args.repeat):
         run_test(tmp_dir=tmp_dir, files_size=files_size,
-                 andiff_app=andiff_app, anpatch_app=anpatch_app)
+                 andiff_app=andiff_app, anpatch_app=anpatch_app,
+                 diff_args=args.diff_args.split(),
+                 use_index=args.use_index,
+                 targets_number=args.targets,
+                 ranges_number=args.ranges,
+                 patch_args=args.patch_args.split(),
+                 reference_args=(None if args.reference_args is None
+                                 else args.reference_args.split()),
+                 mutated_targets=args.mutated_targets,
+                 max_patch_ratio=args.max_patch_ratio)
 
     os.rmdir(tmp_dir)
 